@@ -0,0 +1,353 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "chip8.h"
+#include "scheduler.h"
+#include <time.h>
+#include <unistd.h>
+
+// Runs many independent headless instances on all cores. Every job is one
+// ROM with its own Cxkk seed and keypad script, and reports a hash of its
+// final framebuffer, so a batch run doubles as a regression test. Jobs run
+// in slices of frames on the work-stealing scheduler, as their lengths range
+// from a few frames to the whole run.
+
+#define DEFAULT_FRAMES 3600 // One minute of guest time
+#define DEFAULT_INSTRUCTIONS_PER_FRAME 8
+#define DEFAULT_SLICE_FRAMES 60
+#define MAX_PATH_LENGTH 256
+
+// Keypad bitmask held from a frame on, until the next event
+typedef struct InputEvent
+{
+  uint32_t frame;
+  uint16_t keypad;
+} InputEvent;
+
+typedef struct InputScript
+{
+  char path[MAX_PATH_LENGTH];
+  InputEvent *events;
+  int count;
+} InputScript;
+
+// A ROM loaded once and copied into every instance that runs it
+typedef struct ROMImage
+{
+  char path[MAX_PATH_LENGTH];
+  ChipContext chip;
+} ROMImage;
+
+typedef struct Job
+{
+  int rom;    // Index into roms
+  int script; // Index into scripts, -1 for no input
+  uint32_t seed;
+
+  // Progress, the chip only exists while the job is running
+  ChipContext *chip;
+  uint32_t frame;
+  int event; // Next input script event
+
+  // Results
+  uint64_t instructions;
+  uint64_t frameHash;
+  int halted; // Stopped early on a jump to itself
+  int failed; // Its chip couldn't be allocated, there are no results
+} Job;
+
+typedef struct Batch
+{
+  Job *jobs;
+  int jobCount;
+  uint32_t frames;
+  int instructionsPerFrame;
+  uint32_t sliceFrames;
+} Batch;
+
+static ROMImage *roms;
+static int romCount;
+static InputScript *scripts;
+static int scriptCount;
+
+// Returns the index of the loaded ROM, or -1 if it failed to load
+static int findROM(const char *path)
+{
+    for (int i = 0; i < romCount; i++)
+    {
+        if (strcmp(roms[i].path, path) == 0)
+            return i;
+    }
+
+    roms = realloc(roms, (romCount + 1) * sizeof(ROMImage));
+    ROMImage *rom = &roms[romCount];
+    snprintf(rom->path, sizeof(rom->path), "%s", path);
+    initializeChip(&rom->chip);
+    if (loadROM(path, &rom->chip) != 0)
+        return -1;
+
+    return romCount++;
+}
+
+// Script format: one "<frame> <keypad bitmask in hex>" pair per line, in
+// frame order. Lines starting with # are comments. Returns the index of the
+// script, or -1 if it could not be read.
+static int findScript(const char *path)
+{
+    for (int i = 0; i < scriptCount; i++)
+    {
+        if (strcmp(scripts[i].path, path) == 0)
+            return i;
+    }
+
+    FILE *file = fopen(path, "r");
+    if (!file)
+    {
+        printf("Failed to open input script: %s\n", path);
+        return -1;
+    }
+
+    scripts = realloc(scripts, (scriptCount + 1) * sizeof(InputScript));
+    InputScript *script = &scripts[scriptCount];
+    snprintf(script->path, sizeof(script->path), "%s", path);
+    script->events = NULL;
+    script->count = 0;
+
+    char line[128];
+    while (fgets(line, sizeof(line), file))
+    {
+        unsigned int frame, keypad;
+        if (line[0] == '#' || sscanf(line, "%u %x", &frame, &keypad) != 2)
+            continue;
+
+        script->events = realloc(script->events, (script->count + 1) * sizeof(InputEvent));
+        script->events[script->count].frame = frame;
+        script->events[script->count].keypad = (uint16_t)keypad;
+        script->count++;
+    }
+    fclose(file);
+
+    return scriptCount++;
+}
+
+// A 1nnn jumping to its own address, the usual way a ROM stops
+static int isHalted(const ChipContext *chip)
+{
+    const uint16_t address = chip->PC & 0xFFF;
+    const uint16_t instruction = (chip->memory[address] << 8) | chip->memory[(address + 1) & 0xFFF];
+    return instruction == (0x1000 | address);
+}
+
+// SliceFunction for the scheduler, runs up to sliceFrames frames of a job
+static int runJobSlice(void *context, const int index, const int worker)
+{
+    const Batch *batch = context;
+    Job *job = &batch->jobs[index];
+
+    if (!job->chip)
+    {
+        // ChipContext is too big for a thread stack, and a job that was
+        // stolen has to take its chip along
+        job->chip = malloc(sizeof(ChipContext));
+        if (!job->chip)
+        {
+            job->failed = 1;
+            return 1;
+        }
+        memcpy(job->chip, &roms[job->rom].chip, sizeof(ChipContext));
+        seedRandom(job->chip, job->seed);
+    }
+
+    ChipContext *chip = job->chip;
+    const InputScript *script = job->script >= 0 ? &scripts[job->script] : NULL;
+    const uint32_t sliceEnd = job->frame + batch->sliceFrames;
+    int finished = 0;
+    while (!finished && job->frame < sliceEnd)
+    {
+        while (script && job->event < script->count && script->events[job->event].frame <= job->frame)
+            chip->keypad = script->events[job->event++].keypad;
+
+        int executed;
+        runFrame(chip, batch->instructionsPerFrame, &executed);
+        job->instructions += executed;
+        job->frame++;
+        if (isHalted(chip))
+        {
+            job->halted = 1;
+            finished = 1;
+        }
+        else if (job->frame == batch->frames)
+            finished = 1;
+    }
+    if (!finished)
+        return 0;
+
+    job->frameHash = hashFrameBuffer(chip);
+    free(chip);
+    job->chip = NULL;
+    return 1;
+}
+
+// Job file format: one "<rom> <seed> [input script]" per line
+static int readJobFile(const char *path, Batch *batch)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+    {
+        printf("Failed to open job file: %s\n", path);
+        return 1;
+    }
+
+    char line[3 * MAX_PATH_LENGTH];
+    while (fgets(line, sizeof(line), file))
+    {
+        char romPath[MAX_PATH_LENGTH], scriptPath[MAX_PATH_LENGTH];
+        unsigned int seed;
+        const int fields = sscanf(line, "%255s %u %255s", romPath, &seed, scriptPath);
+        if (line[0] == '#' || fields < 2)
+            continue;
+
+        batch->jobs = realloc(batch->jobs, (batch->jobCount + 1) * sizeof(Job));
+        Job *job = &batch->jobs[batch->jobCount];
+        memset(job, 0, sizeof(Job));
+        job->seed = seed;
+        job->rom = findROM(romPath);
+        job->script = fields == 3 ? findScript(scriptPath) : -1;
+        if (job->rom < 0 || (fields == 3 && job->script < 0))
+        {
+            fclose(file);
+            return 1;
+        }
+        batch->jobCount++;
+    }
+
+    fclose(file);
+    return 0;
+}
+
+static void printUsage(const char *program)
+{
+    printf("Usage: %s [-t threads] [-f frames] [-p instructions_per_frame] [-q slice_frames]\n"
+           "          [-n instances] [-s first_seed] [-k input_script] <rom>...\n"
+           "       %s [-t threads] [-f frames] [-p instructions_per_frame] [-q slice_frames]\n"
+           "          -j <job_file>\n",
+           program, program);
+}
+
+int main(int argc, char *argv[])
+{
+    Batch batch = {0};
+    batch.frames = DEFAULT_FRAMES;
+    batch.instructionsPerFrame = DEFAULT_INSTRUCTIONS_PER_FRAME;
+    batch.sliceFrames = DEFAULT_SLICE_FRAMES;
+
+    int threadCount = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int instances = 1;
+    uint32_t firstSeed = 1;
+    const char *scriptPath = NULL;
+    const char *jobPath = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:f:p:q:n:s:k:j:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            threadCount = atoi(optarg);
+            break;
+        case 'f':
+            batch.frames = (uint32_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            batch.instructionsPerFrame = atoi(optarg);
+            break;
+        case 'q':
+            batch.sliceFrames = (uint32_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            instances = atoi(optarg);
+            break;
+        case 's':
+            firstSeed = (uint32_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'k':
+            scriptPath = optarg;
+            break;
+        case 'j':
+            jobPath = optarg;
+            break;
+        default:
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    if ((!jobPath && optind >= argc) || threadCount <= 0 || instances <= 0 ||
+        batch.instructionsPerFrame <= 0 || batch.frames == 0 || batch.sliceFrames == 0)
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    if (jobPath)
+    {
+        if (readJobFile(jobPath, &batch) != 0)
+            return 1;
+    }
+    else
+    {
+        const int script = scriptPath ? findScript(scriptPath) : -1;
+        if (scriptPath && script < 0)
+            return 1;
+
+        for (int i = optind; i < argc; i++)
+        {
+            const int rom = findROM(argv[i]);
+            if (rom < 0)
+                return 1;
+
+            batch.jobs = realloc(batch.jobs, (batch.jobCount + instances) * sizeof(Job));
+            for (int n = 0; n < instances; n++)
+            {
+                Job *job = &batch.jobs[batch.jobCount++];
+                memset(job, 0, sizeof(Job));
+                job->rom = rom;
+                job->script = script;
+                job->seed = firstSeed + n;
+            }
+        }
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (runScheduler(batch.jobCount, threadCount, runJobSlice, &batch) != 0)
+        return 1;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    uint64_t totalInstructions = 0;
+    int failedCount = 0;
+    printf("%-6s %-24s %10s %12s %6s %16s\n", "job", "rom", "seed", "instructions", "halted", "frame_hash");
+    for (int i = 0; i < batch.jobCount; i++)
+    {
+        const Job *job = &batch.jobs[i];
+        if (job->failed)
+        {
+            printf("%-6d %-24s %10u %12s %6s %16s\n", i, roms[job->rom].path, job->seed, "-", "-", "out of memory");
+            failedCount++;
+            continue;
+        }
+        printf("%-6d %-24s %10u %12llu %6d %016llx\n", i, roms[job->rom].path, job->seed,
+               (unsigned long long)job->instructions, job->halted,
+               (unsigned long long)job->frameHash);
+        totalInstructions += job->instructions;
+    }
+
+    const double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "%d jobs on %d threads in %.3f s, %.2f MIPS\n",
+            batch.jobCount, threadCount, seconds, totalInstructions / seconds / 1e6);
+    if (failedCount > 0)
+    {
+        fprintf(stderr, "%d of %d jobs ran out of memory\n", failedCount, batch.jobCount);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,289 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "chip8.h"
+#include "jit.h"
+#include "lockstep.h"
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_CYCLES 10000000
+#define DEFAULT_RUNS 5
+#define DEFAULT_INSTRUCTIONS_PER_FRAME 8
+#define MAX_RUNS 100
+
+static const char *defaultROMs[] = {
+    "roms/pong.ch8",
+    "roms/breakout.ch8",
+    "roms/test_opcode.ch8"};
+
+enum benchEngine
+{
+  ENGINE_SWITCH = DISPATCH_SWITCH,
+  ENGINE_TABLE = DISPATCH_TABLE,
+  ENGINE_THREADED = DISPATCH_THREADED,
+  ENGINE_JIT,
+  ENGINE_LOCKSTEP,
+  ENGINE_COUNT
+};
+
+static const char *engineNames[] = {
+    "switch",
+    "table",
+    "threaded",
+    "jit",
+    "lockstep"};
+
+// Synthetic workloads, each an endless loop over one kind of instruction
+
+// 8xy_ arithmetic with a rarely taken skip
+static const uint8_t aluProgram[] = {
+    0x60, 0x00, 0x61, 0x01, 0x70, 0x03, 0x81, 0x04, 0x82, 0x13, 0x83, 0x22,
+    0x84, 0x31, 0x85, 0x15, 0x86, 0x0E, 0x30, 0x00, 0x12, 0x04, 0x12, 0x00};
+
+// Dxyn every fourth instruction, walking an 8x8 box across the screen
+static const uint8_t drawProgram[] = {
+    0xA2, 0x0A, 0xD0, 0x18, 0x70, 0x05, 0x71, 0x03, 0x12, 0x02,
+    0xFF, 0x81, 0x81, 0x81, 0x81, 0x81, 0x81, 0xFF};
+
+// drawProgram with the Dxyn replaced by an 8xy0, to subtract from it
+static const uint8_t noDrawProgram[] = {
+    0xA2, 0x0A, 0x82, 0x30, 0x70, 0x05, 0x71, 0x03, 0x12, 0x02,
+    0xFF, 0x81, 0x81, 0x81, 0x81, 0x81, 0x81, 0xFF};
+
+// Fx33, Fx55 and Fx65 through the same few bytes of memory
+static const uint8_t memoryProgram[] = {
+    0xA3, 0x00, 0x70, 0x01, 0xF3, 0x55, 0xF0, 0x33, 0xF3, 0x65, 0x12, 0x02};
+
+// 2nnn and 00EE
+static const uint8_t callProgram[] = {
+    0x22, 0x06, 0x70, 0x01, 0x12, 0x00, 0x71, 0x01, 0x00, 0xEE};
+
+#define DRAW_INTERVAL 4 // Instructions per Dxyn in drawProgram
+
+typedef struct Workload
+{
+  const char *name;
+  const char *path;       // ROM file, or NULL for a synthetic program
+  const uint8_t *program;
+  size_t length;
+} Workload;
+
+#define SYNTHETIC(name, program) {name, NULL, program, sizeof(program)}
+
+static const Workload syntheticWorkloads[] = {
+    SYNTHETIC("alu", aluProgram),
+    SYNTHETIC("nodraw", noDrawProgram),
+    SYNTHETIC("draw", drawProgram),
+    SYNTHETIC("memory", memoryProgram),
+    SYNTHETIC("call", callProgram)};
+
+#undef SYNTHETIC
+
+typedef struct BenchOptions
+{
+  long long cycles;
+  int runs;
+  int instructionsPerFrame;
+} BenchOptions;
+
+// Input script shared by every workload: each key in turn is held for a
+// quarter of a second, then nothing for the rest of the second
+static uint16_t scriptedKeypad(const long long frame)
+{
+    if (frame % TIMER_FREQUENCY >= TIMER_FREQUENCY / 4)
+        return 0;
+    return 1 << ((frame / TIMER_FREQUENCY) % 16);
+}
+
+static int loadWorkload(const Workload *workload, ChipContext *chip)
+{
+    initializeChip(chip);
+    if (workload->path)
+        return loadROM(workload->path, chip);
+    return loadProgram(chip, workload->program, workload->length);
+}
+
+// Runs a workload headless for options->cycles instructions in frames of
+// scripted input, and returns the seconds it took or -1 on error
+static double runWorkload(const Workload *workload, const enum benchEngine engine, const BenchOptions *options)
+{
+    // ChipContext and LockstepContext are too big for the stack
+    static ChipContext chip;
+    static LockstepContext lanes;
+    if (loadWorkload(workload, &chip) != 0)
+        return -1;
+
+    const int frameCycles = options->instructionsPerFrame;
+    long long remaining = options->cycles;
+    long long frame = 0;
+    clock_t start;
+
+    if (engine == ENGINE_JIT)
+    {
+        JitContext *jit = createJit();
+        if (!jit)
+            return -1;
+
+        start = clock();
+        for (; remaining > 0; frame++, remaining -= frameCycles)
+        {
+            chip.keypad = scriptedKeypad(frame);
+            executeJitCycles(jit, &chip, remaining < frameCycles ? (int)remaining : frameCycles);
+            tickTimers(&chip);
+        }
+        destroyJit(jit);
+    }
+    else if (engine == ENGINE_LOCKSTEP)
+    {
+        // The same instruction count, shared out over the lanes
+        for (int lane = 0; lane < LOCKSTEP_LANES; lane++)
+        {
+            seedRandom(&chip, lane);
+            loadLane(&lanes, lane, &chip);
+        }
+        remaining /= LOCKSTEP_LANES;
+
+        start = clock();
+        for (; remaining > 0; frame++, remaining -= frameCycles)
+        {
+            const uint16_t keypad = scriptedKeypad(frame);
+            for (int lane = 0; lane < LOCKSTEP_LANES; lane++)
+                lanes.keypad[lane] = keypad;
+            runLockstepFrame(&lanes, remaining < frameCycles ? (int)remaining : frameCycles);
+        }
+    }
+    else
+    {
+        setDispatchEngine(&chip, (enum dispatchEngine)engine);
+
+        start = clock();
+        for (; remaining > 0; frame++, remaining -= frameCycles)
+        {
+            chip.keypad = scriptedKeypad(frame);
+            executeCPUCycles(&chip, remaining < frameCycles ? (int)remaining : frameCycles);
+            tickTimers(&chip);
+        }
+    }
+
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+// Mean and sample standard deviation of the MIPS of every run. Returns the
+// mean seconds per run, or -1 on error.
+static double benchmarkWorkload(const Workload *workload, const enum benchEngine engine, const BenchOptions *options,
+                                double *mips, double *stddev, double *minimum, double *maximum)
+{
+    double seconds[MAX_RUNS];
+    double total = 0;
+    for (int run = 0; run < options->runs; run++)
+    {
+        seconds[run] = runWorkload(workload, engine, options);
+        if (seconds[run] < 0)
+            return -1;
+        total += seconds[run];
+    }
+
+    double sum = 0, squares = 0;
+    *minimum = INFINITY;
+    *maximum = 0;
+    for (int run = 0; run < options->runs; run++)
+    {
+        const double runMIPS = options->cycles / seconds[run] / 1e6;
+        sum += runMIPS;
+        squares += runMIPS * runMIPS;
+        *minimum = fmin(*minimum, runMIPS);
+        *maximum = fmax(*maximum, runMIPS);
+    }
+    *mips = sum / options->runs;
+    *stddev = options->runs > 1 ? sqrt(fmax(0, (squares - sum * *mips) / (options->runs - 1))) : 0;
+    return total / options->runs;
+}
+
+static void printUsage(const char *program)
+{
+    printf("Usage: %s [-c instructions] [-r runs] [-p instructions_per_frame] [rom.ch8 ...]\n"
+           "       instructions must be a multiple of %d\n",
+           program, LOCKSTEP_LANES);
+}
+
+int main(int argc, char *argv[])
+{
+    BenchOptions options = {DEFAULT_CYCLES, DEFAULT_RUNS, DEFAULT_INSTRUCTIONS_PER_FRAME};
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:r:p:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            options.cycles = strtoll(optarg, NULL, 10);
+            break;
+        case 'r':
+            options.runs = atoi(optarg);
+            break;
+        case 'p':
+            options.instructionsPerFrame = atoi(optarg);
+            break;
+        default:
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    // The lockstep lanes share the instructions out evenly
+    if (options.cycles < LOCKSTEP_LANES || options.cycles % LOCKSTEP_LANES != 0 || options.runs <= 0 || options.runs > MAX_RUNS ||
+        options.instructionsPerFrame <= 0)
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    const char **roms = defaultROMs;
+    int romCount = sizeof(defaultROMs) / sizeof(defaultROMs[0]);
+    if (optind < argc)
+    {
+        roms = (const char **)&argv[optind];
+        romCount = argc - optind;
+    }
+
+    const int syntheticCount = sizeof(syntheticWorkloads) / sizeof(syntheticWorkloads[0]);
+    const int workloadCount = romCount + syntheticCount;
+    Workload *workloads = malloc(workloadCount * sizeof(Workload));
+    if (!workloads)
+        return 1;
+    for (int i = 0; i < romCount; i++)
+    {
+        const Workload rom = {roms[i], roms[i], NULL, 0};
+        workloads[i] = rom;
+    }
+    memcpy(workloads + romCount, syntheticWorkloads, sizeof(syntheticWorkloads));
+
+    // One line per workload and engine, whitespace separated. ns_per_dxyn is
+    // the draw workload's time minus the nodraw one's, per Dxyn, and "-" on
+    // every other line.
+    printf("%-24s %-9s %4s %12s %9s %9s %9s %9s %12s %11s\n", "workload", "engine", "runs", "instructions",
+           "mips", "stddev", "min", "max", "ns_per_instr", "ns_per_dxyn");
+    double noDrawSeconds[ENGINE_COUNT] = {0};
+    for (int i = 0; i < workloadCount; i++)
+    {
+        for (int engine = 0; engine < ENGINE_COUNT; engine++)
+        {
+            double mips, stddev, minimum, maximum;
+            const double seconds = benchmarkWorkload(&workloads[i], engine, &options, &mips, &stddev, &minimum, &maximum);
+            if (seconds < 0)
+                return 1;
+
+            char drawCost[16] = "-";
+            if (strcmp(workloads[i].name, "nodraw") == 0)
+                noDrawSeconds[engine] = seconds;
+            else if (strcmp(workloads[i].name, "draw") == 0)
+                snprintf(drawCost, sizeof(drawCost), "%.2f", (seconds - noDrawSeconds[engine]) * 1e9 / (options.cycles / DRAW_INTERVAL));
+
+            printf("%-24s %-9s %4d %12lld %9.2f %9.2f %9.2f %9.2f %12.3f %11s\n", workloads[i].name, engineNames[engine],
+                   options.runs, options.cycles, mips, stddev, minimum, maximum, seconds * 1e9 / options.cycles, drawCost);
+        }
+    }
+
+    free(workloads);
+    return 0;
+}
@@ -1,6 +1,9 @@
 #include "chip8.h"
 
-#define ROM_START_ADDRESS 0x200
+#if defined(CHIP8_PROFILE) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
+
 #define MAX_ROM_SIZE (4096 - ROM_START_ADDRESS)
 
 const uint8_t fontSet[80] = {
@@ -22,29 +25,6 @@ const uint8_t fontSet[80] = {
     0xF0, 0x80, 0xF0, 0x80, 0x80  // F
 };
 
-// 16 Game Keys
-// 1 2 3 4
-// q w e r
-// a s d f
-// z x c v
-const SDL_Keycode keymap[16] = {
-    SDLK_1,
-    SDLK_2,
-    SDLK_3,
-    SDLK_4,
-    SDLK_q,
-    SDLK_w,
-    SDLK_e,
-    SDLK_r,
-    SDLK_a,
-    SDLK_s,
-    SDLK_d,
-    SDLK_f,
-    SDLK_z,
-    SDLK_x,
-    SDLK_c,
-    SDLK_v};
-
 void initializeChip(ChipContext *chip)
 {
     chip->PC = ROM_START_ADDRESS;
@@ -52,272 +32,941 @@ void initializeChip(ChipContext *chip)
     chip->I = 0;
     chip->delayTimer = 0;
     chip->soundTimer = 0;
+    chip->keypad = 0;
+    seedRandom(chip, 1);
+    chip->memoryLow = MEMORY_SIZE; // Nothing written yet
+    chip->memoryHigh = 0;
 
     memset(chip->V, 0, sizeof(chip->V));
     memset(chip->memory, 0, sizeof(chip->memory));
     memset(chip->frameBuffer, 0, sizeof(chip->frameBuffer));
     memset(chip->stack, 0, sizeof(chip->stack));
+    memset(chip->decoded, 0, sizeof(chip->decoded)); // OP_UNDECODED
+    memset(chip->breakpoints, 0, sizeof(chip->breakpoints));
+    memset(chip->watchpoints, 0, sizeof(chip->watchpoints));
+    memset(chip->watchPages, 0, sizeof(chip->watchPages));
+    chip->watchAddress = 0;
+    chip->watchHit = 0;
+
+    chip->dispatchEngine = DISPATCH_THREADED;
+    chip->trace = NULL;
+#if defined(CHIP8_PROFILE)
+    resetProfile(chip);
+#endif
 
     memcpy(chip->memory, fontSet, sizeof(fontSet));
 }
 
-void executeCPUCycle(ChipContext *chip, Display *display)
+void decodeInstruction(const uint16_t instruction, DecodedInstruction *op)
 {
-    // Get instruction
-    const uint16_t instruction = (chip->memory[chip->PC] << 8) | chip->memory[chip->PC + 1];
-    chip->PC += 2;
-
-    // Helpful constants
-    const uint8_t x = (instruction & 0x0F00) >> 8;
-    const uint8_t y = (instruction & 0x00F0) >> 4;
-    const uint16_t nnn = (instruction & 0x0FFF);
-    const uint8_t kk = (instruction & 0x00FF);
+    op->x = (instruction & 0x0F00) >> 8;
+    op->y = (instruction & 0x00F0) >> 4;
+    op->n = (instruction & 0x000F);
+    op->kk = (instruction & 0x00FF);
+    op->nnn = (instruction & 0x0FFF);
+    op->opcode = OP_INVALID;
 
-    // Instruction handler
     switch ((instruction & 0xF000) >> 12)
     {
 
     case 0x0:
         switch (instruction & 0xFFF)
         {
-
-        case 0x0E0: // 00E0 CLS - Clears display
-            memset(chip->frameBuffer, 0, sizeof(chip->frameBuffer));
-            setDrawLayer(display, BACKGROUND);
-            SDL_RenderClear(display->renderer);
+        case 0x0E0:
+            op->opcode = OP_CLS;
             break;
-
-        case 0x0EE: // 00EE RET - Jumps to address on top of the stack
-            chip->SP--;
-            chip->PC = chip->stack[chip->SP];
+        case 0x0EE:
+            op->opcode = OP_RET;
             break;
         }
         break;
 
-    case 0x1: // 1nnn JP addr
-        chip->PC = nnn;
+    case 0x1:
+        op->opcode = OP_JP;
         break;
-
-    case 0x2:                             // 2nnn CALL addr - Calls subroutine at nnn
-        chip->stack[chip->SP] = chip->PC; // Return address
-        chip->SP++;
-        chip->PC = nnn;
+    case 0x2:
+        op->opcode = OP_CALL;
         break;
-
-    case 0x3: // 3xkk SE Vx, byte
-        if (chip->V[x] == kk)
-            chip->PC += 2;
+    case 0x3:
+        op->opcode = OP_SE_BYTE;
         break;
-
-    case 0x4: // 4xkk SNE Vx, byte
-        if (chip->V[x] != kk)
-            chip->PC += 2;
+    case 0x4:
+        op->opcode = OP_SNE_BYTE;
         break;
-
-    case 0x5: // 5xy0 SE, Vx, Vy
-        if (chip->V[x] == chip->V[y])
-            chip->PC += 2;
+    case 0x5:
+        op->opcode = OP_SE_REG;
         break;
-
-    case 0x6: // 6xkk LD Vx, byte
-        chip->V[x] = kk;
+    case 0x6:
+        op->opcode = OP_LD_BYTE;
         break;
-
-    case 0x7: // 7xkk ADD Vx, byte
-        chip->V[x] += kk;
+    case 0x7:
+        op->opcode = OP_ADD_BYTE;
         break;
 
-    case 0x8: // 8xyk Performs an operation between Vx and Vy
+    case 0x8:
         switch (instruction & 0xF)
         {
-
-        case 0x0: // LD
-            chip->V[x] = chip->V[y];
+        case 0x0:
+            op->opcode = OP_LD_REG;
             break;
-
-        case 0x1: // OR
-            chip->V[x] |= chip->V[y];
+        case 0x1:
+            op->opcode = OP_OR;
             break;
-
-        case 0x2: // AND
-            chip->V[x] &= chip->V[y];
+        case 0x2:
+            op->opcode = OP_AND;
             break;
-
-        case 0x3: // XOR
-            chip->V[x] ^= chip->V[y];
+        case 0x3:
+            op->opcode = OP_XOR;
             break;
-
-        case 0x4: // ADD
-        {
-            uint16_t result = chip->V[x] + chip->V[y];
-            chip->V[x] = (uint8_t)result;
-            chip->V[0xF] = (result > 0xFF) ? 1 : 0; // Set carry
+        case 0x4:
+            op->opcode = OP_ADD_REG;
             break;
-        }
-
-        case 0x5: // SUB
-            chip->V[0xF] = (chip->V[x] > chip->V[y]) ? 1 : 0;
-            chip->V[x] -= chip->V[y];
+        case 0x5:
+            op->opcode = OP_SUB;
             break;
-
-        case 0x6: // SHR Vx {, Vy}
-            chip->V[0xF] = (chip->V[x] & 1);
-            chip->V[x] >>= 1;
+        case 0x6:
+            op->opcode = OP_SHR;
             break;
-
-        case 0x7: // SUBN Vx {, Vy}
-            chip->V[0xF] = (chip->V[y] > chip->V[x]) ? 1 : 0;
-            chip->V[x] = chip->V[y] - chip->V[x];
+        case 0x7:
+            op->opcode = OP_SUBN;
             break;
-
-        case 0xE: // SHL Vx {, Vy}
-            chip->V[0xF] = (chip->V[x] >> 7);
-            chip->V[x] <<= 1;
+        case 0xE:
+            op->opcode = OP_SHL;
             break;
         }
         break;
 
-    case 0x9: // 9xy0 SNE Vx, Vy - Skips next instruction if Vx != Vy
-        if (chip->V[x] != chip->V[y])
-            chip->PC += 2;
+    case 0x9:
+        op->opcode = OP_SNE_REG;
         break;
-
-    case 0xA: // Annn LD I, addr - Loads address into I
-        chip->I = nnn;
+    case 0xA:
+        op->opcode = OP_LD_I;
+        break;
+    case 0xB:
+        op->opcode = OP_JP_V0;
+        break;
+    case 0xC:
+        op->opcode = OP_RND;
+        break;
+    case 0xD:
+        op->opcode = OP_DRW;
         break;
 
-    case 0xB: // Bnnn JP V0, addr - Jump to nnn + V0
-        chip->PC = nnn + chip->V[0];
+    case 0xE:
+        switch (instruction & 0x00FF)
+        {
+        case 0x9E:
+            op->opcode = OP_SKP;
+            break;
+        case 0xA1:
+            op->opcode = OP_SKNP;
+            break;
+        }
         break;
 
-    case 0xC: // Cxkk RND Vx, Byte 0 - Vx = a random 8-bit value & kk
-    {
-        uint8_t randomValue = rand() % (256);
-        chip->V[x] = randomValue & kk;
+    case 0xF:
+        switch (instruction & 0x00FF)
+        {
+        case 0x07:
+            op->opcode = OP_LD_VX_DT;
+            break;
+        case 0x0A:
+            op->opcode = OP_LD_VX_K;
+            break;
+        case 0x15:
+            op->opcode = OP_LD_DT_VX;
+            break;
+        case 0x18:
+            op->opcode = OP_LD_ST_VX;
+            break;
+        case 0x1E:
+            op->opcode = OP_ADD_I_VX;
+            break;
+        case 0x29:
+            op->opcode = OP_LD_F_VX;
+            break;
+        case 0x33:
+            op->opcode = OP_LD_B_VX;
+            break;
+        case 0x55:
+            op->opcode = OP_LD_MEM_VX;
+            break;
+        case 0x65:
+            op->opcode = OP_LD_VX_MEM;
+            break;
+        }
         break;
     }
+}
 
-    case 0xD: // Dxyn DRW Vx, VY, nibble
+void invalidateDecoded(ChipContext *chip, const uint16_t address, const uint16_t length)
+{
+    // An instruction starting one byte before the write overlaps it too
+    for (int i = -1; i < length; i++)
+        chip->decoded[(address + i) & 0xFFF].opcode = OP_UNDECODED;
+}
+
+// Widens the written range kept for save states. A write that wraps past
+// 0xFFF widens it to all of memory.
+static inline void markWritten(ChipContext *chip, uint16_t address, const uint16_t length)
+{
+    address &= 0xFFF;
+    uint16_t end = address + length;
+    if (end > MEMORY_SIZE)
     {
-        uint8_t n = instruction & 0x000F;
-        uint8_t yStart = chip->V[y];
-        uint8_t xStart = chip->V[x];
-        chip->V[0xF] = 0;
+        address = 0;
+        end = MEMORY_SIZE;
+    }
+    if (address < chip->memoryLow)
+        chip->memoryLow = address;
+    if (end > chip->memoryHigh)
+        chip->memoryHigh = end;
+}
 
-        for (int row = 0; row < n; row++)
+// Finds the first address in [address, address + length) watched for access
+static int findWatched(ChipContext *chip, const uint16_t address, const int length, const uint8_t access)
+{
+    for (int i = 0; i < length; i++)
+    {
+        const uint16_t watched = (address + i) & 0xFFF;
+        if (chip->watchpoints[watched] & access)
         {
-            uint8_t pixel = chip->memory[chip->I + row];
-            uint8_t ycoord = (yStart + row) % DISPLAY_HEIGHT;
-            for (int col = 0; col < 8; col++)
-            {
-                if ((pixel & (0b10000000 >> col)))
-                {
-                    uint8_t xcoord = (xStart + col) % DISPLAY_WIDTH;
-
-                    if (chip->frameBuffer[ycoord][xcoord])
-                    {
-                        chip->V[0xF] = 1; // collision detected
-                        setDrawLayer(display, BACKGROUND);
-                        drawPixel(display, ycoord, xcoord);
-                        chip->frameBuffer[ycoord][xcoord] = 0;
-                    }
-                    else
-                    {
-                        setDrawLayer(display, FOREGROUND);
-                        drawPixel(display, ycoord, xcoord);
-                        chip->frameBuffer[ycoord][xcoord] = 1;
-                    }
-                }
-            }
+            chip->watchAddress = watched;
+            chip->watchHit = 1;
+            return 1;
         }
     }
-    break;
+    return 0;
+}
 
-    case 0xE:
-        switch (instruction & 0x00FF)
-        {
+// Nonzero if an access to [address, address + length) touched a watchpoint.
+// A range is at most 16 bytes, so it spans at most two pages, and their
+// bits are all that is read unless a watchpoint is in one of them.
+static inline int isWatched(ChipContext *chip, const uint16_t address, const int length, const uint8_t access)
+{
+    const uint8_t pages = chip->watchPages[(address & 0xFFF) / WATCH_PAGE_SIZE] |
+                          chip->watchPages[((address + length - 1) & 0xFFF) / WATCH_PAGE_SIZE];
+    return (pages & access) && findWatched(chip, address, length, access);
+}
+
+// Instruction handlers, shared by every dispatch engine. PC has already been
+// advanced past the instruction when they run. They return CPU_EXIT_NONE to
+// keep running or the reason the CPU has to stop after them.
+
+static inline int opInvalid(ChipContext *chip, const DecodedInstruction *op)
+{
+    // Unknown instructions stop the CPU before they execute
+    chip->PC -= 2;
+    return CPU_EXIT_INVALID_OPCODE;
+}
+
+static inline int opCls(ChipContext *chip, const DecodedInstruction *op)
+{
+    // 00E0 CLS - Clears display
+    memset(chip->frameBuffer, 0, sizeof(chip->frameBuffer));
+    return CPU_EXIT_DRAW;
+}
+
+static inline int opRet(ChipContext *chip, const DecodedInstruction *op)
+{
+    // 00EE RET - Jumps to address on top of the stack
+    chip->SP--;
+    chip->PC = chip->stack[chip->SP];
+    return CPU_EXIT_NONE;
+}
+
+static inline int opJp(ChipContext *chip, const DecodedInstruction *op)
+{
+    // 1nnn JP addr
+    chip->PC = op->nnn;
+    return CPU_EXIT_NONE;
+}
+
+static inline int opCall(ChipContext *chip, const DecodedInstruction *op)
+{
+    // 2nnn CALL addr - Calls subroutine at nnn
+    chip->stack[chip->SP] = chip->PC; // Return address
+    chip->SP++;
+    chip->PC = op->nnn;
+    return CPU_EXIT_NONE;
+}
+
+static inline int opSeByte(ChipContext *chip, const DecodedInstruction *op)
+{
+    // 3xkk SE Vx, byte
+    if (chip->V[op->x] == op->kk)
+        chip->PC += 2;
+    return CPU_EXIT_NONE;
+}
+
+static inline int opSneByte(ChipContext *chip, const DecodedInstruction *op)
+{
+    // 4xkk SNE Vx, byte
+    if (chip->V[op->x] != op->kk)
+        chip->PC += 2;
+    return CPU_EXIT_NONE;
+}
 
-        case 0x9E: // Ex9E SKP Vx - If key V[x] is pressed skip next
+static inline int opSeReg(ChipContext *chip, const DecodedInstruction *op)
+{
+    // 5xy0 SE, Vx, Vy
+    if (chip->V[op->x] == chip->V[op->y])
+        chip->PC += 2;
+    return CPU_EXIT_NONE;
+}
+
+static inline int opLdByte(ChipContext *chip, const DecodedInstruction *op)
+{
+    // 6xkk LD Vx, byte
+    chip->V[op->x] = op->kk;
+    return CPU_EXIT_NONE;
+}
+
+static inline int opAddByte(ChipContext *chip, const DecodedInstruction *op)
+{
+    // 7xkk ADD Vx, byte
+    chip->V[op->x] += op->kk;
+    return CPU_EXIT_NONE;
+}
+
+static inline int opLdReg(ChipContext *chip, const DecodedInstruction *op)
+{
+    // 8xy0 LD
+    chip->V[op->x] = chip->V[op->y];
+    return CPU_EXIT_NONE;
+}
+
+static inline int opOr(ChipContext *chip, const DecodedInstruction *op)
+{
+    // 8xy1 OR
+    chip->V[op->x] |= chip->V[op->y];
+    return CPU_EXIT_NONE;
+}
+
+static inline int opAnd(ChipContext *chip, const DecodedInstruction *op)
+{
+    // 8xy2 AND
+    chip->V[op->x] &= chip->V[op->y];
+    return CPU_EXIT_NONE;
+}
+
+static inline int opXor(ChipContext *chip, const DecodedInstruction *op)
+{
+    // 8xy3 XOR
+    chip->V[op->x] ^= chip->V[op->y];
+    return CPU_EXIT_NONE;
+}
+
+static inline int opAddReg(ChipContext *chip, const DecodedInstruction *op)
+{
+    // 8xy4 ADD
+    uint16_t result = chip->V[op->x] + chip->V[op->y];
+    chip->V[op->x] = (uint8_t)result;
+    chip->V[0xF] = (result > 0xFF) ? 1 : 0; // Set carry
+    return CPU_EXIT_NONE;
+}
+
+static inline int opSub(ChipContext *chip, const DecodedInstruction *op)
+{
+    // 8xy5 SUB
+    chip->V[0xF] = (chip->V[op->x] > chip->V[op->y]) ? 1 : 0;
+    chip->V[op->x] -= chip->V[op->y];
+    return CPU_EXIT_NONE;
+}
+
+static inline int opShr(ChipContext *chip, const DecodedInstruction *op)
+{
+    // 8xy6 SHR Vx {, Vy}
+    chip->V[0xF] = (chip->V[op->x] & 1);
+    chip->V[op->x] >>= 1;
+    return CPU_EXIT_NONE;
+}
+
+static inline int opSubn(ChipContext *chip, const DecodedInstruction *op)
+{
+    // 8xy7 SUBN Vx {, Vy}
+    chip->V[0xF] = (chip->V[op->y] > chip->V[op->x]) ? 1 : 0;
+    chip->V[op->x] = chip->V[op->y] - chip->V[op->x];
+    return CPU_EXIT_NONE;
+}
+
+static inline int opShl(ChipContext *chip, const DecodedInstruction *op)
+{
+    // 8xyE SHL Vx {, Vy}
+    chip->V[0xF] = (chip->V[op->x] >> 7);
+    chip->V[op->x] <<= 1;
+    return CPU_EXIT_NONE;
+}
+
+static inline int opSneReg(ChipContext *chip, const DecodedInstruction *op)
+{
+    // 9xy0 SNE Vx, Vy - Skips next instruction if Vx != Vy
+    if (chip->V[op->x] != chip->V[op->y])
+        chip->PC += 2;
+    return CPU_EXIT_NONE;
+}
+
+static inline int opLdI(ChipContext *chip, const DecodedInstruction *op)
+{
+    // Annn LD I, addr - Loads address into I
+    chip->I = op->nnn;
+    return CPU_EXIT_NONE;
+}
+
+static inline int opJpV0(ChipContext *chip, const DecodedInstruction *op)
+{
+    // Bnnn JP V0, addr - Jump to nnn + V0
+    chip->PC = op->nnn + chip->V[0];
+    return CPU_EXIT_NONE;
+}
+
+static inline int opRnd(ChipContext *chip, const DecodedInstruction *op)
+{
+    // Cxkk RND Vx, Byte 0 - Vx = a random 8-bit value & kk
+    chip->V[op->x] = nextRandom(&chip->rngState) & op->kk;
+    return CPU_EXIT_NONE;
+}
+
+static inline int opDrw(ChipContext *chip, const DecodedInstruction *op)
+{
+    // Dxyn DRW Vx, VY, nibble - Each sprite byte is rotated into place and
+    // XORed into its framebuffer row, so it wraps around the right edge
+    const uint8_t n = op->n;
+    const uint8_t yStart = chip->V[op->y];
+    const uint8_t xStart = chip->V[op->x] % DISPLAY_WIDTH;
+    uint64_t collision = 0;
+
+    for (int row = 0; row < n; row++)
+    {
+        const uint64_t pixels = (uint64_t)chip->memory[(chip->I + row) & 0xFFF] << (DISPLAY_WIDTH - 8);
+        const uint64_t sprite = (pixels >> xStart) | (pixels << ((DISPLAY_WIDTH - xStart) % DISPLAY_WIDTH));
+        uint64_t *line = &chip->frameBuffer[(yStart + row) % DISPLAY_HEIGHT];
+
+        collision |= *line & sprite;
+        *line ^= sprite;
+    }
+
+    chip->V[0xF] = collision != 0; // collision detected
+    isWatched(chip, chip->I, n, WATCH_READ); // Still a draw, watchHit tells the host
+    return CPU_EXIT_DRAW;
+}
+
+static inline int opSkp(ChipContext *chip, const DecodedInstruction *op)
+{
+    // Ex9E SKP Vx - If key V[x] is pressed skip next
+    if (chip->keypad & (1 << (chip->V[op->x] & 0xF)))
+        chip->PC += 2;
+    return CPU_EXIT_NONE;
+}
+
+static inline int opSknp(ChipContext *chip, const DecodedInstruction *op)
+{
+    // ExA1 SKP Vx - If key V[x] is not pressed skip next
+    if (!(chip->keypad & (1 << (chip->V[op->x] & 0xF))))
+        chip->PC += 2;
+    return CPU_EXIT_NONE;
+}
+
+static inline int opLdVxDt(ChipContext *chip, const DecodedInstruction *op)
+{
+    // Fx07 LD Vx, DT - load delay timer in to Vx
+    chip->V[op->x] = chip->delayTimer;
+    return CPU_EXIT_NONE;
+}
+
+static inline int opLdVxK(ChipContext *chip, const DecodedInstruction *op)
+{
+    // Fx0A LD Vx, K - Wait for a key press, store the value of the key in Vx
+    if (chip->keypad == 0)
+    {
+        chip->PC -= 2;
+        return CPU_EXIT_KEY_WAIT;
+    }
+    chip->V[op->x] = lowestKey(chip->keypad);
+    return CPU_EXIT_NONE;
+}
+
+static inline int opLdDtVx(ChipContext *chip, const DecodedInstruction *op)
+{
+    // Fx15 LD DT, Vx
+    chip->delayTimer = chip->V[op->x];
+    return CPU_EXIT_NONE;
+}
+
+static inline int opLdStVx(ChipContext *chip, const DecodedInstruction *op)
+{
+    // Fx18 LD ST, Vx
+    chip->soundTimer = chip->V[op->x];
+    return CPU_EXIT_NONE;
+}
+
+static inline int opAddIVx(ChipContext *chip, const DecodedInstruction *op)
+{
+    // Fx1E ADD I, Vx - I
+    chip->I += chip->V[op->x];
+    return CPU_EXIT_NONE;
+}
+
+static inline int opLdFVx(ChipContext *chip, const DecodedInstruction *op)
+{
+    // Fx29 LD F, Vx
+    chip->I = chip->V[op->x] * 5;
+    return CPU_EXIT_NONE;
+}
+
+static inline int opLdBVx(ChipContext *chip, const DecodedInstruction *op)
+{
+    // Fx33 LD B, Vx - Stores decimal digits of Vx at mem[I + 0, 1, 2]
+    const uint8_t value = chip->V[op->x];
+    chip->memory[chip->I & 0xFFF] = value / 100;
+    chip->memory[(chip->I + 1) & 0xFFF] = (value / 10) % 10;
+    chip->memory[(chip->I + 2) & 0xFFF] = value % 10;
+    invalidateDecoded(chip, chip->I, 3);
+    markWritten(chip, chip->I, 3);
+    return isWatched(chip, chip->I, 3, WATCH_WRITE) ? CPU_EXIT_WATCHPOINT : CPU_EXIT_NONE;
+}
+
+static inline int opLdMemVx(ChipContext *chip, const DecodedInstruction *op)
+{
+    // Fx55 LD [I], Vx - Copies V[] into memory at I
+    const uint8_t x = op->x; // op may be invalidated by the write below
+    for (int i = 0; i <= x; i++)
+        chip->memory[(chip->I + i) & 0xFFF] = chip->V[i];
+    invalidateDecoded(chip, chip->I, x + 1);
+    markWritten(chip, chip->I, x + 1);
+    return isWatched(chip, chip->I, x + 1, WATCH_WRITE) ? CPU_EXIT_WATCHPOINT : CPU_EXIT_NONE;
+}
+
+static inline int opLdVxMem(ChipContext *chip, const DecodedInstruction *op)
+{
+    // Fx65 LD Vx, [I] - Copies memory starting at I to V[]
+    for (int i = 0; i <= op->x; i++)
+        chip->V[i] = chip->memory[(chip->I + i) & 0xFFF];
+    return isWatched(chip, chip->I, op->x + 1, WATCH_READ) ? CPU_EXIT_WATCHPOINT : CPU_EXIT_NONE;
+}
+
+static inline int opBreakpoint(ChipContext *chip, const DecodedInstruction *op)
+{
+    // Stands in for the instruction under a breakpoint, see runCPU
+    chip->PC -= 2;
+    return CPU_EXIT_BREAKPOINT;
+}
+
+// Every decoded opcode with its handler, expanded by each dispatch engine
+#define FOR_EACH_OPCODE(X)        \
+    X(OP_UNDECODED, opInvalid)    \
+    X(OP_INVALID, opInvalid)      \
+    X(OP_CLS, opCls)              \
+    X(OP_RET, opRet)              \
+    X(OP_JP, opJp)                \
+    X(OP_CALL, opCall)            \
+    X(OP_SE_BYTE, opSeByte)       \
+    X(OP_SNE_BYTE, opSneByte)     \
+    X(OP_SE_REG, opSeReg)         \
+    X(OP_LD_BYTE, opLdByte)       \
+    X(OP_ADD_BYTE, opAddByte)     \
+    X(OP_LD_REG, opLdReg)         \
+    X(OP_OR, opOr)                \
+    X(OP_AND, opAnd)              \
+    X(OP_XOR, opXor)              \
+    X(OP_ADD_REG, opAddReg)       \
+    X(OP_SUB, opSub)              \
+    X(OP_SHR, opShr)              \
+    X(OP_SUBN, opSubn)            \
+    X(OP_SHL, opShl)              \
+    X(OP_SNE_REG, opSneReg)       \
+    X(OP_LD_I, opLdI)             \
+    X(OP_JP_V0, opJpV0)           \
+    X(OP_RND, opRnd)              \
+    X(OP_DRW, opDrw)              \
+    X(OP_SKP, opSkp)              \
+    X(OP_SKNP, opSknp)            \
+    X(OP_LD_VX_DT, opLdVxDt)      \
+    X(OP_LD_VX_K, opLdVxK)        \
+    X(OP_LD_DT_VX, opLdDtVx)      \
+    X(OP_LD_ST_VX, opLdStVx)      \
+    X(OP_ADD_I_VX, opAddIVx)      \
+    X(OP_LD_F_VX, opLdFVx)        \
+    X(OP_LD_B_VX, opLdBVx)        \
+    X(OP_LD_MEM_VX, opLdMemVx)    \
+    X(OP_LD_VX_MEM, opLdVxMem)    \
+    X(OP_BREAKPOINT, opBreakpoint)
+
+typedef int (*OpHandler)(ChipContext *chip, const DecodedInstruction *op);
+
+#define TABLE_ENTRY(opcode, handler) [opcode] = handler,
+static const OpHandler opHandlers[OP_COUNT] = {FOR_EACH_OPCODE(TABLE_ENTRY)};
+#undef TABLE_ENTRY
+
+#if defined(CHIP8_PROFILE)
+#if defined(__x86_64__) || defined(__i386__)
+static inline uint64_t readCycleCounter(void)
+{
+    return __rdtsc();
+}
+#elif defined(__aarch64__)
+static inline uint64_t readCycleCounter(void)
+{
+    uint64_t ticks;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+}
+#else
+static inline uint64_t readCycleCounter(void)
+{
+    return 0; // No counter, only executions are counted
+}
+#endif
+
+// Every engine calls its handlers through RUN_HANDLER, which only costs
+// anything in a profiling build
+static inline int runProfiled(ChipContext *chip, const DecodedInstruction *op, const OpHandler handler)
+{
+    const uint8_t opcode = op->opcode; // op may be invalidated by the handler
+    const uint64_t start = readCycleCounter();
+    const int result = handler(chip, op);
+    chip->profile.ticks[opcode] += readCycleCounter() - start;
+    chip->profile.count[opcode]++;
+    return result;
+}
+#define RUN_HANDLER(handler, chip, op) runProfiled(chip, op, handler)
+#else
+#define RUN_HANDLER(handler, chip, op) handler(chip, op)
+#endif
+
+// Records an instruction that just ran at address. Not inlined: the engines
+// only call it while a trace is attached.
+static void traceInstruction(ChipContext *chip, const uint16_t address, const int result)
+{
+    // These stopped in front of the instruction without running it
+    if (result == CPU_EXIT_INVALID_OPCODE || result == CPU_EXIT_BREAKPOINT)
+        return;
+
+    TraceBuffer *trace = chip->trace;
+    TraceRecord *record = &trace->records[trace->next & (TRACE_RECORDS - 1)];
+    record->PC = address;
+    record->instruction = (chip->memory[address] << 8) | chip->memory[(address + 1) & 0xFFF];
+    record->I = chip->I;
+    record->vx = chip->V[(record->instruction >> 8) & 0xF];
+    record->vf = chip->V[0xF];
+    trace->next++;
+}
+
+// Runs the handler for the instruction at address, then traces it
+#define EXECUTE(handler, chip, op, address)  \
+    result = RUN_HANDLER(handler, chip, op); \
+    if (chip->trace)                         \
+        traceInstruction(chip, address, result);
+
+static inline int isBreakpoint(const ChipContext *chip, const uint16_t address)
+{
+    return chip->breakpoints[address >> 3] & (1 << (address & 7));
+}
+
+// Returns the decoded instruction at PC, decoding it on first use
+static inline const DecodedInstruction *fetchDecoded(ChipContext *chip)
+{
+    const uint16_t address = chip->PC & 0xFFF;
+    DecodedInstruction *op = &chip->decoded[address];
+    if (op->opcode == OP_UNDECODED)
+    {
+        decodeInstruction((chip->memory[address] << 8) | chip->memory[(address + 1) & 0xFFF], op);
+        if (isBreakpoint(chip, address))
+            op->opcode = OP_BREAKPOINT;
+    }
+    return op;
+}
+
+// The engines run until *cycles reaches zero or a handler asks to stop, and
+// leave the unused part of the budget in *cycles
+
+// Reference engine: one switch over the decoded opcode per instruction
+static enum cpuExit runSwitch(ChipContext *chip, int *cycles)
+{
+#define SWITCH_CASE(opcode, handler)             \
+    case opcode:                                 \
+        result = RUN_HANDLER(handler, chip, op); \
+        break;
+
+    int remaining = *cycles;
+    int result = CPU_EXIT_CYCLES;
+    while (remaining > 0)
+    {
+        const uint16_t address = chip->PC & 0xFFF;
+        const DecodedInstruction *op = fetchDecoded(chip);
+        chip->PC += 2;
+        remaining--;
+        switch (op->opcode)
         {
-            const uint8_t *keyStates = SDL_GetKeyboardState(NULL);
-            SDL_Scancode code = SDL_GetScancodeFromKey(keymap[chip->V[x]]);
-            if (keyStates[code])
-                chip->PC += 2;
-            break;
+            FOR_EACH_OPCODE(SWITCH_CASE)
         }
+        if (chip->trace)
+            traceInstruction(chip, address, result);
+        if (result != CPU_EXIT_NONE)
+            break;
+        result = CPU_EXIT_CYCLES;
+    }
+    *cycles = remaining;
+    return result;
+#undef SWITCH_CASE
+}
+
+// Calls through a table of handler pointers indexed by opcode
+static enum cpuExit runTable(ChipContext *chip, int *cycles)
+{
+    int remaining = *cycles;
+    int result = CPU_EXIT_CYCLES;
+    while (remaining > 0)
+    {
+        const uint16_t address = chip->PC & 0xFFF;
+        const DecodedInstruction *op = fetchDecoded(chip);
+        chip->PC += 2;
+        remaining--;
+        EXECUTE(opHandlers[op->opcode], chip, op, address)
+        if (result != CPU_EXIT_NONE)
+            break;
+        result = CPU_EXIT_CYCLES;
+    }
+    *cycles = remaining;
+    return result;
+}
+
+#if defined(__GNUC__)
+// Threaded code: every handler ends in its own indirect jump to the next one,
+// giving the branch predictor one history per opcode instead of one shared
+// dispatch branch
+static enum cpuExit runThreaded(ChipContext *chip, int *cycles)
+{
+#define LABEL_ENTRY(opcode, handler) [opcode] = &&label_##opcode,
+    static const void *labels[OP_COUNT] = {FOR_EACH_OPCODE(LABEL_ENTRY)};
+#undef LABEL_ENTRY
+
+    int remaining = *cycles;
+    int result = CPU_EXIT_CYCLES;
+    const DecodedInstruction *op;
+    uint16_t address;
+
+#define DISPATCH()                    \
+    if (remaining <= 0)               \
+        goto done;                    \
+    address = chip->PC & 0xFFF;       \
+    op = fetchDecoded(chip);          \
+    chip->PC += 2;                    \
+    remaining--;                      \
+    goto *labels[op->opcode];
+
+#define LABEL_BODY(opcode, handler)     \
+    label_##opcode:                     \
+    EXECUTE(handler, chip, op, address) \
+    if (result != CPU_EXIT_NONE)        \
+        goto done;                  \
+    DISPATCH()
+
+    DISPATCH()
+    FOR_EACH_OPCODE(LABEL_BODY)
+
+#undef LABEL_BODY
+#undef DISPATCH
+
+done:
+    *cycles = remaining;
+    return result == CPU_EXIT_NONE ? CPU_EXIT_CYCLES : result;
+}
+#else
+#define runThreaded runTable
+#endif
 
-        case 0xA1: // ExA1 SKP Vx - If key V[x] is not pressed skip next
+void setDispatchEngine(ChipContext *chip, const enum dispatchEngine engine)
+{
+    chip->dispatchEngine = engine;
+}
+
+void setBreakpoint(ChipContext *chip, const uint16_t address)
+{
+    chip->breakpoints[(address & 0xFFF) >> 3] |= 1 << (address & 7);
+    chip->decoded[address & 0xFFF].opcode = OP_UNDECODED;
+}
+
+void clearBreakpoint(ChipContext *chip, const uint16_t address)
+{
+    chip->breakpoints[(address & 0xFFF) >> 3] &= ~(1 << (address & 7));
+    chip->decoded[address & 0xFFF].opcode = OP_UNDECODED;
+}
+
+// Watchpoints stop runCPU with CPU_EXIT_WATCHPOINT after the instruction
+// that touched them, like a hardware data breakpoint
+void setWatchpoint(ChipContext *chip, const uint16_t address, const uint16_t length, const uint8_t access)
+{
+    for (int i = 0; i < length; i++)
+    {
+        const uint16_t watched = (address + i) & 0xFFF;
+        chip->watchpoints[watched] |= access;
+        chip->watchPages[watched / WATCH_PAGE_SIZE] |= access;
+    }
+}
+
+void clearWatchpoint(ChipContext *chip, const uint16_t address, const uint16_t length)
+{
+    for (int i = 0; i < length; i++)
+        chip->watchpoints[(address + i) & 0xFFF] = 0;
+
+    memset(chip->watchPages, 0, sizeof(chip->watchPages));
+    for (int watched = 0; watched < MEMORY_SIZE; watched++)
+        chip->watchPages[watched / WATCH_PAGE_SIZE] |= chip->watchpoints[watched];
+}
+
+enum cpuExit runCPU(ChipContext *chip, const int maxCycles, int *executed)
+{
+    int cycles = maxCycles;
+    int result = CPU_EXIT_CYCLES;
+#if defined(CHIP8_PROFILE)
+    const uint64_t start = readCycleCounter();
+#endif
+
+    // Resuming from a breakpoint runs the instruction under it first
+    if (cycles > 0 && fetchDecoded(chip)->opcode == OP_BREAKPOINT)
+    {
+        const uint16_t address = chip->PC & 0xFFF;
+        DecodedInstruction op;
+        decodeInstruction((chip->memory[address] << 8) | chip->memory[(address + 1) & 0xFFF], &op);
+        chip->PC += 2;
+        cycles--;
+        EXECUTE(opHandlers[op.opcode], chip, &op, address)
+        if (result == CPU_EXIT_NONE)
+            result = CPU_EXIT_CYCLES;
+    }
+
+    if (result == CPU_EXIT_CYCLES)
+    {
+        switch (chip->dispatchEngine)
         {
-            const uint8_t *keyStates = SDL_GetKeyboardState(NULL);
-            SDL_Scancode code = SDL_GetScancodeFromKey(keymap[chip->V[x]]);
-            if (!keyStates[code])
-                chip->PC += 2;
+        case DISPATCH_SWITCH:
+            result = runSwitch(chip, &cycles);
+            break;
+        case DISPATCH_TABLE:
+            result = runTable(chip, &cycles);
+            break;
+        case DISPATCH_THREADED:
+            result = runThreaded(chip, &cycles);
             break;
         }
-        }
-        break;
+    }
 
-    case 0xF:
-        switch (instruction & 0x00FF)
-        {
+    // These stop in front of the instruction instead of after it
+    if (result == CPU_EXIT_INVALID_OPCODE || result == CPU_EXIT_BREAKPOINT)
+        cycles++;
 
-        case 0x07: // Fx07 LD Vx, DT - load delay timer in to Vx
-            chip->V[x] = chip->delayTimer;
-            break;
+    if (executed)
+        *executed = maxCycles - cycles;
+#if defined(CHIP8_PROFILE)
+    chip->profile.totalTicks += readCycleCounter() - start;
+#endif
+    return result;
+}
 
-        case 0x0A: // LD Vx, K - Wait for a key press, store the value of the key in Vx
+// Runs one decoded instruction on its handler, for hosts that fetch and
+// decode themselves, like the JIT. PC must already be past the instruction.
+// Returns CPU_EXIT_NONE or why the CPU would have stopped after it.
+int executeDecoded(ChipContext *chip, const DecodedInstruction *op)
+{
+    return RUN_HANDLER(opHandlers[op->opcode], chip, op);
+}
+
+void executeCPUCycles(ChipContext *chip, int cycles)
+{
+    // Runs straight through every event: unknown instructions are skipped,
+    // Fx0A keeps re-executing and breakpoints and watchpoints are ignored
+    while (cycles > 0)
+    {
+        int executed;
+        const enum cpuExit result = runCPU(chip, cycles, &executed);
+        cycles -= executed;
+
+        if (result == CPU_EXIT_INVALID_OPCODE)
         {
-            const uint8_t *keyStates = SDL_GetKeyboardState(NULL);
-            uint8_t pressed = 0;
-            for (int i = 0; i < 16; i++)
-            {
-                SDL_Scancode code = SDL_GetScancodeFromKey(keymap[i]);
-                if (keyStates[code])
-                {
-                    chip->V[x] = i;
-                    pressed = 1;
-                    break;
-                }
-            }
-            if (pressed == 0)
-                chip->PC -= 2;
+            chip->PC += 2;
+            cycles--;
         }
-        break;
+    }
+}
 
-        case 0x15: // Fx15 LD DT, Vx
-            chip->delayTimer = chip->V[x];
-            break;
+void executeCPUCycle(ChipContext *chip)
+{
+    executeCPUCycles(chip, 1);
+}
 
-        case 0x18: // Fx18 LD ST, Vx
-            chip->soundTimer = chip->V[x];
-            break;
+void tickTimers(ChipContext *chip)
+{
+    if (chip->delayTimer > 0)
+        chip->delayTimer--;
+    if (chip->soundTimer > 0)
+        chip->soundTimer--;
+}
 
-        case 0x1E: // Fx1E ADD I, Vx - I
-            chip->I += chip->V[x];
-            break;
+// FNV-1a over the framebuffer rows, for comparing runs
+uint64_t hashFrameBuffer(const ChipContext *chip)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (int y = 0; y < DISPLAY_HEIGHT; y++)
+    {
+        for (int shift = 56; shift >= 0; shift -= 8)
+        {
+            hash ^= (chip->frameBuffer[y] >> shift) & 0xFF;
+            hash *= 0x100000001B3ULL;
+        }
+    }
+    return hash;
+}
 
-        case 0x29: // Fx29 LD F, Vx
-            chip->I = chip->V[x] * 5;
-            break;
+void seedRandom(ChipContext *chip, const uint32_t seed)
+{
+    // Scramble the seed (MurmurHash3's finalizer) so nearby seeds give
+    // unrelated sequences, and keep xorshift away from its stuck zero state
+    uint32_t x = seed + 0x9E3779B9;
+    x = (x ^ (x >> 16)) * 0x85EBCA6B;
+    x = (x ^ (x >> 13)) * 0xC2B2AE35;
+    x ^= x >> 16;
+    chip->rngState = x ? x : 1;
+}
 
-        case 0x33: // Fx33 LD B, Vx - Stores decimal digits of Vx at mem[I + 0, 1, 2]
-            chip->memory[chip->I] = chip->V[x] / 100;
-            chip->memory[chip->I + 1] = (chip->V[x] / 10) % 10;
-            chip->memory[chip->I + 2] = chip->V[x] % 10;
-            break;
+// Nonzero while the next instruction is an Fx0A with no key down. Until a key
+// goes down, running the chip changes nothing but the timers.
+int isWaitingForKey(const ChipContext *chip)
+{
+    const uint16_t address = chip->PC & 0xFFF;
+    const uint16_t instruction = (chip->memory[address] << 8) | chip->memory[(address + 1) & 0xFFF];
+    return chip->keypad == 0 && (instruction & 0xF0FF) == 0xF00A;
+}
 
-        case 0x55: // Fx55 LD [I], Vx - Copies V[] into memory at I
-            for (int i = 0; i <= x; i++)
-                chip->memory[chip->I + i] = chip->V[i];
-            break;
+int runFrame(ChipContext *chip, const int instructionsPerFrame, int *executed)
+{
+    // Same event handling as executeCPUCycles, remembering whether anything
+    // was drawn. A key wait ends the frame early: the keypad can't change
+    // before the next one, so re-executing Fx0A would only burn the budget.
+    // executed, if given, receives how many instructions actually ran.
+    int cycles = instructionsPerFrame;
+    int drawn = 0;
+    while (cycles > 0)
+    {
+        int executed;
+        const enum cpuExit result = runCPU(chip, cycles, &executed);
+        cycles -= executed;
 
-        case 0x65: // Fx65 LD Vx, [I] - Copies memory starting at I to V[]
-            for (int i = 0; i <= x; i++)
-                chip->V[i] = chip->memory[chip->I + i];
+        if (result == CPU_EXIT_KEY_WAIT)
             break;
+        else if (result == CPU_EXIT_DRAW)
+            drawn = 1;
+        else if (result == CPU_EXIT_INVALID_OPCODE)
+        {
+            chip->PC += 2;
+            cycles--;
         }
-        break;
     }
+
+    if (executed)
+        *executed = instructionsPerFrame - cycles;
+    tickTimers(chip);
+    return drawn;
 }
 
 int loadROM(const char *filename, ChipContext *chip)
@@ -360,77 +1009,323 @@ int loadROM(const char *filename, ChipContext *chip)
 
     // Close the file
     fclose(file);
+
+    // Drop anything decoded from the previous memory contents
+    invalidateDecoded(chip, ROM_START_ADDRESS, fileSize);
+    markWritten(chip, ROM_START_ADDRESS, fileSize);
     return 0; // Success
 }
 
-void drawPixel(Display *display, const uint8_t y, const uint8_t x)
+// Save state layout, multi-byte values little endian:
+//   "C8S" version
+//   V0-VF, I, PC, SP, delay timer, sound timer, keypad, RNG state
+//   SP stack entries
+//   framebuffer rows
+//   memoryLow, memoryHigh, memory[memoryLow..memoryHigh)
+// Memory outside the saved range is the font and zeros, so a state only
+// restores correctly onto a chip with the same ROM loaded.
+
+static inline uint8_t *put16(uint8_t *p, const uint16_t value)
 {
-    SDL_Rect rect = {x * SCALE, y * SCALE, SCALE, SCALE};
-    SDL_RenderFillRect(display->renderer, &rect);
+    p[0] = value & 0xFF;
+    p[1] = value >> 8;
+    return p + 2;
 }
 
-void setDrawLayer(Display *display, const enum layer layerName)
+static inline const uint8_t *get16(const uint8_t *p, uint16_t *value)
 {
-    if (display->drawLayer == layerName)
-        return;
+    *value = p[0] | (p[1] << 8);
+    return p + 2;
+}
+
+// Written byte by byte so the format doesn't depend on the host; compilers
+// merge these into single loads and stores on little-endian hosts
+static inline uint8_t *put64(uint8_t *p, const uint64_t value)
+{
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+    p[2] = (value >> 16) & 0xFF;
+    p[3] = (value >> 24) & 0xFF;
+    p[4] = (value >> 32) & 0xFF;
+    p[5] = (value >> 40) & 0xFF;
+    p[6] = (value >> 48) & 0xFF;
+    p[7] = value >> 56;
+    return p + 8;
+}
 
-    switch (layerName)
+static inline const uint8_t *get64(const uint8_t *p, uint64_t *value)
+{
+    *value = (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+             ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+    return p + 8;
+}
+
+size_t saveState(const ChipContext *chip, uint8_t *buffer, const size_t size)
+{
+    // A stack that over- or underflowed can't be restored, see restoreState
+    if (chip->SP > 16)
+        return 0;
+
+    const uint8_t depth = chip->SP;
+    const uint16_t low = chip->memoryLow;
+    const uint16_t high = chip->memoryHigh > low ? chip->memoryHigh : low;
+    const size_t needed = 4 + 16 + 13 + depth * 2 + DISPLAY_HEIGHT * 8 + 4 + (high - low);
+    if (size < needed)
+        return 0;
+
+    uint8_t *p = buffer;
+    *p++ = 'C';
+    *p++ = '8';
+    *p++ = 'S';
+    *p++ = SAVE_STATE_VERSION;
+
+    memcpy(p, chip->V, 16);
+    p += 16;
+    p = put16(p, chip->I);
+    p = put16(p, chip->PC);
+    *p++ = chip->SP;
+    *p++ = chip->delayTimer;
+    *p++ = chip->soundTimer;
+    p = put16(p, chip->keypad);
+    p = put16(p, chip->rngState & 0xFFFF);
+    p = put16(p, chip->rngState >> 16);
+
+    for (int i = 0; i < depth; i++)
+        p = put16(p, chip->stack[i]);
+
+    for (int y = 0; y < DISPLAY_HEIGHT; y++)
+        p = put64(p, chip->frameBuffer[y]);
+
+    p = put16(p, low);
+    p = put16(p, high);
+    memcpy(p, chip->memory + low, high - low);
+    p += high - low;
+
+    return p - buffer;
+}
+
+// Writes only the bytes that differ, so the decoded instructions of code
+// that didn't change stay cached
+static void restoreMemory(ChipContext *chip, const uint16_t address, const uint8_t *bytes, const uint16_t length)
+{
+    for (int chunk = 0; chunk < length; chunk += 64)
     {
-    case BACKGROUND:
-        SDL_SetRenderDrawColor(display->renderer, 0, 0, 0, 255);
-        display->drawLayer = BACKGROUND;
-        break;
-    case FOREGROUND:
-        SDL_SetRenderDrawColor(display->renderer, 255, 255, 255, 255);
-        display->drawLayer = FOREGROUND;
-        break;
-    default:
-        printf("Layer does not exist.");
-        break;
+        const int chunkLength = length - chunk < 64 ? length - chunk : 64;
+        if (memcmp(chip->memory + address + chunk, bytes + chunk, chunkLength) == 0)
+            continue;
+
+        for (int i = chunk; i < chunk + chunkLength; i++)
+        {
+            if (chip->memory[address + i] != bytes[i])
+            {
+                chip->memory[address + i] = bytes[i];
+                invalidateDecoded(chip, address + i, 1);
+            }
+        }
     }
 }
 
-int initializeGraphics(Display *display, const int width, const int height)
+// Puts memory written since the state was saved back to its initial contents
+static void resetMemory(ChipContext *chip, const uint16_t low, const uint16_t high)
 {
-
-    // Initialize the video subsystem
-    if (SDL_Init(SDL_INIT_VIDEO) < 0)
+    static const uint8_t zeros[MEMORY_SIZE];
+    for (uint16_t address = low; address < high; address++)
     {
-        printf("SDL could not be initialized: %s\n", SDL_GetError());
+        const uint8_t *initial = address < sizeof(fontSet) ? &fontSet[address] : &zeros[address];
+        restoreMemory(chip, address, initial, 1);
+    }
+}
+
+int restoreState(ChipContext *chip, const uint8_t *buffer, const size_t size)
+{
+    // Check everything before touching the chip
+    const size_t registersSize = 4 + 16 + 13;
+    if (size < registersSize || buffer[0] != 'C' || buffer[1] != '8' || buffer[2] != 'S' || buffer[3] != SAVE_STATE_VERSION)
+        return 1;
+
+    // SP counts the return addresses on the stack, so it is at most 16
+    const uint8_t depth = buffer[4 + 16 + 4];
+    if (depth > 16)
         return 1;
+    const size_t memoryOffset = registersSize + depth * 2 + DISPLAY_HEIGHT * 8;
+    if (size < memoryOffset + 4)
+        return 1;
+
+    uint16_t low, high;
+    get16(get16(buffer + memoryOffset, &low), &high);
+    if (high < low || high > MEMORY_SIZE || size < memoryOffset + 4 + (high - low))
+        return 1;
+
+    const uint8_t *p = buffer + 4;
+    memcpy(chip->V, p, 16);
+    p += 16;
+    p = get16(p, &chip->I);
+    p = get16(p, &chip->PC);
+    chip->SP = *p++;
+    chip->delayTimer = *p++;
+    chip->soundTimer = *p++;
+    p = get16(p, &chip->keypad);
+    uint16_t rngLow, rngHigh;
+    p = get16(p, &rngLow);
+    p = get16(p, &rngHigh);
+    chip->rngState = rngLow | ((uint32_t)rngHigh << 16);
+
+    for (int i = 0; i < depth; i++)
+        p = get16(p, &chip->stack[i]);
+
+    for (int y = 0; y < DISPLAY_HEIGHT; y++)
+        p = get64(p, &chip->frameBuffer[y]);
+
+    p += 4; // Memory range, read above
+
+    // Whatever the chip wrote outside the saved range goes back to the
+    // font and zeros before the saved range is copied in
+    if (chip->memoryLow < low)
+        resetMemory(chip, chip->memoryLow, chip->memoryHigh < low ? chip->memoryHigh : low);
+    if (chip->memoryHigh > high)
+        resetMemory(chip, chip->memoryLow > high ? chip->memoryLow : high, chip->memoryHigh);
+    restoreMemory(chip, low, p, high - low);
+    chip->memoryLow = low;
+    chip->memoryHigh = high;
+
+    return 0;
+}
+
+// Same as loadROM for a program that is already in memory
+int loadProgram(ChipContext *chip, const uint8_t *program, const size_t length)
+{
+    if (length > MAX_ROM_SIZE)
+    {
+        printf("Program is too large. Maximum size is %d bytes.\n", MAX_ROM_SIZE);
+        return -1;
     }
-    else
+
+    memcpy(chip->memory + ROM_START_ADDRESS, program, length);
+    invalidateDecoded(chip, ROM_START_ADDRESS, length);
+    markWritten(chip, ROM_START_ADDRESS, length);
+    return 0;
+}
+
+#if defined(CHIP8_PROFILE)
+static const char *opcodeNames[OP_COUNT] = {
+    [OP_UNDECODED] = "---- undecoded",
+    [OP_INVALID] = "???? invalid",
+    [OP_CLS] = "00E0 CLS",
+    [OP_RET] = "00EE RET",
+    [OP_JP] = "1nnn JP",
+    [OP_CALL] = "2nnn CALL",
+    [OP_SE_BYTE] = "3xkk SE",
+    [OP_SNE_BYTE] = "4xkk SNE",
+    [OP_SE_REG] = "5xy0 SE",
+    [OP_LD_BYTE] = "6xkk LD",
+    [OP_ADD_BYTE] = "7xkk ADD",
+    [OP_LD_REG] = "8xy0 LD",
+    [OP_OR] = "8xy1 OR",
+    [OP_AND] = "8xy2 AND",
+    [OP_XOR] = "8xy3 XOR",
+    [OP_ADD_REG] = "8xy4 ADD",
+    [OP_SUB] = "8xy5 SUB",
+    [OP_SHR] = "8xy6 SHR",
+    [OP_SUBN] = "8xy7 SUBN",
+    [OP_SHL] = "8xyE SHL",
+    [OP_SNE_REG] = "9xy0 SNE",
+    [OP_LD_I] = "Annn LD I",
+    [OP_JP_V0] = "Bnnn JP V0",
+    [OP_RND] = "Cxkk RND",
+    [OP_DRW] = "Dxyn DRW",
+    [OP_SKP] = "Ex9E SKP",
+    [OP_SKNP] = "ExA1 SKNP",
+    [OP_LD_VX_DT] = "Fx07 LD DT",
+    [OP_LD_VX_K] = "Fx0A LD K",
+    [OP_LD_DT_VX] = "Fx15 LD DT",
+    [OP_LD_ST_VX] = "Fx18 LD ST",
+    [OP_ADD_I_VX] = "Fx1E ADD I",
+    [OP_LD_F_VX] = "Fx29 LD F",
+    [OP_LD_B_VX] = "Fx33 LD B",
+    [OP_LD_MEM_VX] = "Fx55 LD [I]",
+    [OP_LD_VX_MEM] = "Fx65 LD [I]",
+    [OP_BREAKPOINT] = "---- breakpoint"};
+
+void resetProfile(ChipContext *chip)
+{
+    memset(&chip->profile, 0, sizeof(chip->profile));
+
+    // Every handler's ticks include one counter read, measured as the
+    // fastest of many back to back reads
+    uint64_t readTicks = UINT64_MAX;
+    for (int i = 0; i < 1000; i++)
     {
-        printf("SDL video system is ready to go\n");
+        const uint64_t start = readCycleCounter();
+        const uint64_t ticks = readCycleCounter() - start;
+        if (ticks < readTicks)
+            readTicks = ticks;
     }
+    chip->profile.readTicks = readTicks;
+}
 
-    // Create the window
-    display->window = SDL_CreateWindow("CHIP8",
-                                       SDL_WINDOWPOS_CENTERED,
-                                       SDL_WINDOWPOS_CENTERED,
-                                       width,
-                                       height,
-                                       SDL_WINDOW_SHOWN);
-    if (!display->window)
+// Ticks less the counter reads that were measured along with them
+static uint64_t netTicks(const uint64_t ticks, const uint64_t reads, const uint64_t readTicks)
+{
+    return ticks > reads * readTicks ? ticks - reads * readTicks : 0;
+}
+
+static void printProfileLine(FILE *out, const char *name, const uint64_t count, const uint64_t ticks,
+                             const uint64_t totalCount, const uint64_t totalTicks)
+{
+    fprintf(out, "%-16s %12llu %6.2f %14llu %6.2f %9.1f\n", name, (unsigned long long)count,
+            totalCount ? 100.0 * count / totalCount : 0.0, (unsigned long long)ticks,
+            totalTicks ? 100.0 * ticks / totalTicks : 0.0, count ? (double)ticks / count : 0.0);
+}
+
+// One line per executed opcode, then per family (first hex digit), then the
+// time runCPU spent outside the handlers: fetch, decode and dispatch. The
+// cost of the counter reads is taken out, but the profiled build still
+// inlines differently, so compare shares rather than absolute ticks.
+void printProfile(const ChipContext *chip, FILE *out)
+{
+    const OpcodeProfile *profile = &chip->profile;
+    uint64_t count[OP_COUNT], ticks[OP_COUNT];
+    uint64_t totalCount = 0, handlerTicks = 0;
+    for (int opcode = 0; opcode < OP_COUNT; opcode++)
     {
-        printf("Window could not be created: %s\n", SDL_GetError());
-        SDL_Quit();
-        return 1;
+        count[opcode] = profile->count[opcode];
+        ticks[opcode] = netTicks(profile->ticks[opcode], count[opcode], profile->readTicks);
+        totalCount += count[opcode];
+        handlerTicks += profile->ticks[opcode];
     }
 
-    // Create the renderer
-    display->renderer = SDL_CreateRenderer(display->window, -1, SDL_RENDERER_SOFTWARE);
-    if (!display->renderer)
+    // Each instruction reads the counter twice, so the dispatch time has
+    // one read per instruction to take out on top of the handlers' time
+    const uint64_t dispatchTicks = netTicks(profile->totalTicks - handlerTicks, totalCount, profile->readTicks);
+    uint64_t totalTicks = dispatchTicks;
+    for (int opcode = 0; opcode < OP_COUNT; opcode++)
+        totalTicks += ticks[opcode];
+
+    fprintf(out, "%-16s %12s %6s %14s %6s %9s\n", "opcode", "count", "count%", "ticks", "ticks%", "ticks/op");
+    for (int opcode = 0; opcode < OP_COUNT; opcode++)
     {
-        printf("Failed to create renderer: %s\n", SDL_GetError());
-        SDL_DestroyWindow(display->window);
-        SDL_Quit();
-        return 1;
+        if (count[opcode])
+            printProfileLine(out, opcodeNames[opcode], count[opcode], ticks[opcode], totalCount, totalTicks);
     }
 
-    // Initialize draw color
-    SDL_SetRenderDrawColor(display->renderer, 255, 255, 255, 255);
-    display->drawLayer = FOREGROUND;
+    const char *digits = "0123456789ABCDEF";
+    for (int family = 0; family < 16; family++)
+    {
+        uint64_t familyCount = 0, familyTicks = 0;
+        for (int opcode = 0; opcode < OP_COUNT; opcode++)
+        {
+            if (opcodeNames[opcode][0] == digits[family])
+            {
+                familyCount += count[opcode];
+                familyTicks += ticks[opcode];
+            }
+        }
+        char name[8];
+        snprintf(name, sizeof(name), "%c___", digits[family]);
+        if (familyCount)
+            printProfileLine(out, name, familyCount, familyTicks, totalCount, totalTicks);
+    }
 
-    return 0; // Success
-}
\ No newline at end of file
+    printProfileLine(out, "dispatch", totalCount, dispatchTicks, totalCount, totalTicks);
+}
+#endif
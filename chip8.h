@@ -5,44 +5,221 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
-#include <SDL2/SDL.h>
 
 #define DISPLAY_WIDTH 64
 #define DISPLAY_HEIGHT 32
-#define SCALE 10
+#define MEMORY_SIZE (4 * 1024)
+#define ROM_START_ADDRESS 0x200
+#define TIMER_FREQUENCY 60 // Hz, also the frame rate
 
-enum layer
+// Save states: header, registers, stack, framebuffer and the written part of memory
+#define SAVE_STATE_VERSION 2
+#define MAX_SAVE_STATE_SIZE (4 + 16 + 13 + 16 * 2 + DISPLAY_HEIGHT * 8 + 4 + MEMORY_SIZE)
+
+enum opcode
+{
+  OP_UNDECODED, // Cache slot has not been decoded yet (or was invalidated)
+  OP_INVALID,   // Unknown instruction, executed as a no-op
+  OP_CLS,       // 00E0
+  OP_RET,       // 00EE
+  OP_JP,        // 1nnn
+  OP_CALL,      // 2nnn
+  OP_SE_BYTE,   // 3xkk
+  OP_SNE_BYTE,  // 4xkk
+  OP_SE_REG,    // 5xy0
+  OP_LD_BYTE,   // 6xkk
+  OP_ADD_BYTE,  // 7xkk
+  OP_LD_REG,    // 8xy0
+  OP_OR,        // 8xy1
+  OP_AND,       // 8xy2
+  OP_XOR,       // 8xy3
+  OP_ADD_REG,   // 8xy4
+  OP_SUB,       // 8xy5
+  OP_SHR,       // 8xy6
+  OP_SUBN,      // 8xy7
+  OP_SHL,       // 8xyE
+  OP_SNE_REG,   // 9xy0
+  OP_LD_I,      // Annn
+  OP_JP_V0,     // Bnnn
+  OP_RND,       // Cxkk
+  OP_DRW,       // Dxyn
+  OP_SKP,       // Ex9E
+  OP_SKNP,      // ExA1
+  OP_LD_VX_DT,  // Fx07
+  OP_LD_VX_K,   // Fx0A
+  OP_LD_DT_VX,  // Fx15
+  OP_LD_ST_VX,  // Fx18
+  OP_ADD_I_VX,  // Fx1E
+  OP_LD_F_VX,   // Fx29
+  OP_LD_B_VX,   // Fx33
+  OP_LD_MEM_VX, // Fx55
+  OP_LD_VX_MEM, // Fx65
+  OP_BREAKPOINT, // Placeholder for the instruction under a breakpoint
+  OP_COUNT
+};
+
+// An instruction split into its operands once, so it can be re-executed
+// without fetching and decoding it again
+typedef struct DecodedInstruction
+{
+  uint8_t opcode; // enum opcode
+  uint8_t x;
+  uint8_t y;
+  uint8_t n;
+  uint8_t kk;
+  uint16_t nnn;
+} DecodedInstruction;
+
+// How executeCPUCycles dispatches decoded instructions to their handlers
+enum dispatchEngine
+{
+  DISPATCH_SWITCH,  // Switch over the opcode, kept as the reference
+  DISPATCH_TABLE,   // Indirect call through a handler table
+  DISPATCH_THREADED // Computed goto threaded code (handler table without GCC/clang)
+};
+
+// Why runCPU returned
+enum cpuExit
+{
+  CPU_EXIT_NONE,          // Internal: keep running
+  CPU_EXIT_CYCLES,        // Ran the whole instruction budget
+  CPU_EXIT_DRAW,          // 00E0 or Dxyn changed the framebuffer
+  CPU_EXIT_KEY_WAIT,      // Fx0A found no key down and will run again
+  CPU_EXIT_BREAKPOINT,    // PC is on a breakpoint, not executed yet
+  CPU_EXIT_WATCHPOINT,    // Fx33, Fx55 or Fx65 touched ChipContext::watchAddress
+  CPU_EXIT_INVALID_OPCODE // PC is on an unknown instruction, not executed
+};
+
+#define WATCH_PAGE_SIZE 256
+
+// What a watchpoint stops on. Only guest data accesses are checked: Dxyn
+// and Fx65 read, Fx33 and Fx55 write.
+enum watchAccess
 {
-  FOREGROUND,
-  BACKGROUND
+  WATCH_READ = 1,
+  WATCH_WRITE = 2
 };
 
-typedef struct Display
+// One executed instruction in a TraceBuffer: where it ran, what it was and
+// the registers it may have changed, as they were after it ran
+typedef struct TraceRecord
 {
-  SDL_Renderer *renderer;
-  SDL_Window *window;
-  enum layer drawLayer;
-} Display;
+  uint16_t PC;
+  uint16_t instruction;
+  uint16_t I;
+  uint8_t vx; // V[x], x being the instruction's second nibble
+  uint8_t vf;
+} TraceRecord;
+
+#define TRACE_RECORDS (64 * 1024) // Power of two
+
+// The last TRACE_RECORDS instructions a chip executed. Allocated once and
+// written only by the thread running the chip, without locks; see trace.h.
+typedef struct TraceBuffer
+{
+  TraceRecord records[TRACE_RECORDS];
+  uint64_t next; // Instructions traced so far, the newest is next - 1
+} TraceBuffer;
+
+#if defined(CHIP8_PROFILE)
+// Executions and host time per decoded opcode, kept when the core is built
+// with -DCHIP8_PROFILE. Times are in cycle counter ticks (rdtsc on x86).
+typedef struct OpcodeProfile
+{
+  uint64_t count[OP_COUNT];
+  uint64_t ticks[OP_COUNT];
+  uint64_t totalTicks; // All of runCPU, so fetch and dispatch are the rest
+  uint64_t readTicks;  // Cost of reading the counter, taken out when printing
+} OpcodeProfile;
+#endif
 
 typedef struct ChipContext
 {
-  uint8_t memory[4 * 1024]; // 4096 bytes of memory
-  uint8_t V[16];            // 16 8-bit registers
-  uint16_t stack[16];       // 16 byte stack
+  uint8_t memory[MEMORY_SIZE]; // 4096 bytes of memory
+  uint8_t V[16];               // 16 8-bit registers
+  uint16_t stack[16];          // 16 byte stack
 
   uint16_t I;
   uint16_t PC;        // Program Counter
   uint8_t SP;         // Stack Pointer
   uint8_t delayTimer; // Delay timer
   uint8_t soundTimer; // Sound register
-  uint8_t frameBuffer[DISPLAY_HEIGHT][DISPLAY_WIDTH];
+  uint16_t keypad;    // Bit n set while key n is held down
+  uint32_t rngState;  // Cxkk generator, see seedRandom
+  uint16_t memoryLow;  // Memory outside [memoryLow, memoryHigh) still holds
+  uint16_t memoryHigh; // the font and zeros from initializeChip
+  uint64_t frameBuffer[DISPLAY_HEIGHT]; // One bit per pixel, see getPixel
+
+  // Decoded instruction for every memory address, filled in on first execution
+  DecodedInstruction decoded[MEMORY_SIZE];
+  uint8_t dispatchEngine; // enum dispatchEngine
+  uint8_t breakpoints[MEMORY_SIZE / 8]; // One bit per address
+  uint8_t watchpoints[MEMORY_SIZE];     // enum watchAccess bits per address
+  uint8_t watchPages[MEMORY_SIZE / WATCH_PAGE_SIZE]; // Every watchpoint's bits in the page
+  uint16_t watchAddress; // Watched address the last watch hit touched
+  uint8_t watchHit;      // Set with watchAddress, also by a Dxyn that still exits as a draw; the host clears it
+  TraceBuffer *trace; // Set by the host to trace the interpreter, NULL when off
+#if defined(CHIP8_PROFILE)
+  OpcodeProfile profile;
+#endif
 } ChipContext;
 
+// Pixel at (x, y), column 0 is the most significant bit of its row
+static inline int getPixel(const ChipContext *chip, const int x, const int y)
+{
+  return (chip->frameBuffer[y] >> (DISPLAY_WIDTH - 1 - x)) & 1;
+}
+
+// Cxkk generator: xorshift32, kept per chip so instances running on
+// different threads stay independent and reproducible. Returns the top byte,
+// the best mixed one.
+static inline uint8_t nextRandom(uint32_t *state)
+{
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return x >> 24;
+}
+
+// Lowest key held down in a keypad bitmask, which must not be zero
+static inline int lowestKey(const uint16_t keypad)
+{
+#if defined(__GNUC__)
+  return __builtin_ctz(keypad);
+#else
+  int key = 0;
+  while (!(keypad & (1 << key)))
+    key++;
+  return key;
+#endif
+}
+
 void initializeChip(ChipContext *chip);
-int initializeGraphics(Display *display, const int width, const int height);
 int loadROM(const char *filename, ChipContext *chip);
-void executeCPUCycle(ChipContext *chip, Display *display);
-void setDrawLayer(Display *display, const enum layer layerName);
-void drawPixel(Display *display, const uint8_t x, const uint8_t y);
+int loadProgram(ChipContext *chip, const uint8_t *program, const size_t length);
+void executeCPUCycle(ChipContext *chip);
+void executeCPUCycles(ChipContext *chip, int cycles);
+enum cpuExit runCPU(ChipContext *chip, const int maxCycles, int *executed);
+int executeDecoded(ChipContext *chip, const DecodedInstruction *op);
+int runFrame(ChipContext *chip, const int instructionsPerFrame, int *executed);
+int isWaitingForKey(const ChipContext *chip);
+void tickTimers(ChipContext *chip);
+void seedRandom(ChipContext *chip, const uint32_t seed);
+uint64_t hashFrameBuffer(const ChipContext *chip);
+void setDispatchEngine(ChipContext *chip, const enum dispatchEngine engine);
+void setBreakpoint(ChipContext *chip, const uint16_t address);
+void clearBreakpoint(ChipContext *chip, const uint16_t address);
+void setWatchpoint(ChipContext *chip, const uint16_t address, const uint16_t length, const uint8_t access);
+void clearWatchpoint(ChipContext *chip, const uint16_t address, const uint16_t length);
+void decodeInstruction(const uint16_t instruction, DecodedInstruction *op);
+void invalidateDecoded(ChipContext *chip, const uint16_t address, const uint16_t length);
+size_t saveState(const ChipContext *chip, uint8_t *buffer, const size_t size);
+int restoreState(ChipContext *chip, const uint8_t *buffer, const size_t size);
+#if defined(CHIP8_PROFILE)
+void resetProfile(ChipContext *chip);
+void printProfile(const ChipContext *chip, FILE *out);
+#endif
 
 #endif // CHIP8_H
\ No newline at end of file
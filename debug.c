@@ -0,0 +1,218 @@
+#include "chip8.h"
+#include "trace.h"
+
+// Command line debugger: reads commands from stdin and runs the ROM headless
+// between them, in frames of instructions_per_frame like the emulator.
+//   b <addr>                   set a breakpoint
+//   db <addr>                  delete a breakpoint
+//   w <addr> [length] [r|w|rw] watch memory, read and write by default
+//   dw <addr> [length]         delete watchpoints
+//   c [frames]                 continue until something stops it
+//   s [count]                  step instructions
+//   r                          show registers
+//   x <addr> [length]          dump memory
+//   l [addr] [count]           disassemble, from PC by default
+//   k <keypad>                 set the keypad bitmask, in hex
+//   q                          quit
+// Addresses and lengths are hex, frame and instruction counts decimal.
+
+#define DEFAULT_INSTRUCTIONS_PER_FRAME 8
+#define DEFAULT_CONTINUE_FRAMES (60 * 60 * TIMER_FREQUENCY)
+
+typedef struct Debugger
+{
+  ChipContext chip;
+  int instructionsPerFrame;
+  int cyclesLeft; // In the current frame
+  uint32_t frame;
+} Debugger;
+
+static uint16_t instructionAt(const ChipContext *chip, const uint16_t address)
+{
+    return (chip->memory[address & 0xFFF] << 8) | chip->memory[(address + 1) & 0xFFF];
+}
+
+static void printInstruction(const ChipContext *chip, const uint16_t address)
+{
+    char text[32];
+    const uint16_t instruction = instructionAt(chip, address);
+    disassemble(instruction, text, sizeof(text));
+    printf("%03X  %04X  %s\n", address & 0xFFF, instruction, text);
+}
+
+static void printRegisters(const Debugger *debugger)
+{
+    const ChipContext *chip = &debugger->chip;
+    printf("frame %u  PC=%03X I=%03X SP=%X DT=%02X ST=%02X keypad=%04X\n", debugger->frame, chip->PC, chip->I,
+           chip->SP, chip->delayTimer, chip->soundTimer, chip->keypad);
+    for (int i = 0; i < 16; i++)
+        printf("V%X=%02X%c", i, chip->V[i], i == 15 ? '\n' : ' ');
+    printInstruction(chip, chip->PC);
+}
+
+// Runs up to maxInstructions instructions and maxFrames frame ends. Returns
+// nonzero if something stopped it first, after saying what.
+static int run(Debugger *debugger, long long maxInstructions, uint32_t maxFrames)
+{
+    ChipContext *chip = &debugger->chip;
+    while (maxInstructions > 0 && maxFrames > 0)
+    {
+        if (debugger->cyclesLeft == 0)
+        {
+            tickTimers(chip);
+            debugger->frame++;
+            debugger->cyclesLeft = debugger->instructionsPerFrame;
+            maxFrames--;
+            continue;
+        }
+
+        const int budget = maxInstructions < debugger->cyclesLeft ? (int)maxInstructions : debugger->cyclesLeft;
+        int executed;
+        const enum cpuExit result = runCPU(chip, budget, &executed);
+        debugger->cyclesLeft -= executed;
+        maxInstructions -= executed;
+
+        switch (result)
+        {
+        case CPU_EXIT_BREAKPOINT:
+            printf("Breakpoint at %03X\n", chip->PC);
+            return 1;
+        case CPU_EXIT_DRAW:
+            // A Dxyn that read a watchpoint stops as a draw, with watchHit set
+            if (!chip->watchHit)
+                break;
+            // Fall through
+        case CPU_EXIT_WATCHPOINT:
+            // Only Fx33, Fx55, Fx65 and Dxyn touch watchpoints, none of them jumps
+            chip->watchHit = 0;
+            printf("Watchpoint at %03X touched by ", chip->watchAddress);
+            printInstruction(chip, chip->PC - 2);
+            return 1;
+        case CPU_EXIT_INVALID_OPCODE:
+            printf("Unknown instruction at %03X\n", chip->PC);
+            return 1;
+        case CPU_EXIT_KEY_WAIT:
+            // runCPU only waits with no key down, and only k can press one,
+            // so running on would just spin. The frame ends as in runFrame.
+            debugger->cyclesLeft = 0;
+            printf("Waiting for a key at %03X\n", chip->PC);
+            return 1;
+        default:
+            break;
+        }
+    }
+    return 0;
+}
+
+// Parses "r", "w" or "rw" into enum watchAccess bits, 0 if it is neither
+static uint8_t parseAccess(const char *text)
+{
+    if (strcmp(text, "r") == 0)
+        return WATCH_READ;
+    if (strcmp(text, "w") == 0)
+        return WATCH_WRITE;
+    if (strcmp(text, "rw") == 0)
+        return WATCH_READ | WATCH_WRITE;
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        printf("Usage: %s <rom> [instructions_per_frame] < commands\n", argv[0]);
+        return 1;
+    }
+
+    // Debugger holds a ChipContext, too big for the stack
+    static Debugger debugger;
+    initializeChip(&debugger.chip);
+    if (loadROM(argv[1], &debugger.chip) != 0)
+        return 1;
+    debugger.instructionsPerFrame = argc > 2 ? atoi(argv[2]) : DEFAULT_INSTRUCTIONS_PER_FRAME;
+    if (debugger.instructionsPerFrame <= 0)
+    {
+        printf("Instructions per frame must be positive\n");
+        return 1;
+    }
+    debugger.cyclesLeft = debugger.instructionsPerFrame;
+
+    char line[256];
+    printf("> ");
+    fflush(stdout);
+    while (fgets(line, sizeof(line), stdin))
+    {
+        char *tokens[4] = {NULL};
+        int count = 0;
+        for (char *token = strtok(line, " \t\r\n"); token && count < 4; token = strtok(NULL, " \t\r\n"))
+            tokens[count++] = token;
+
+        ChipContext *chip = &debugger.chip;
+        const char *command = count > 0 ? tokens[0] : "";
+        const uint16_t address = count > 1 ? (uint16_t)strtoul(tokens[1], NULL, 16) : chip->PC;
+
+        if (count == 0)
+            ;
+        else if (strcmp(command, "b") == 0 && count > 1)
+            setBreakpoint(chip, address);
+        else if (strcmp(command, "db") == 0 && count > 1)
+            clearBreakpoint(chip, address);
+        else if ((strcmp(command, "w") == 0 || strcmp(command, "dw") == 0) && count > 1)
+        {
+            // Length and access may come in either order
+            uint16_t length = 1;
+            uint8_t access = WATCH_READ | WATCH_WRITE;
+            for (int i = 2; i < count; i++)
+            {
+                if (parseAccess(tokens[i]))
+                    access = parseAccess(tokens[i]);
+                else
+                    length = (uint16_t)strtoul(tokens[i], NULL, 16);
+            }
+            if (command[0] == 'w')
+                setWatchpoint(chip, address, length, access);
+            else
+                clearWatchpoint(chip, address, length);
+        }
+        else if (strcmp(command, "c") == 0)
+        {
+            // Frame and step counts are decimal
+            run(&debugger, INT64_MAX, count > 1 ? (uint32_t)strtoul(tokens[1], NULL, 10) : DEFAULT_CONTINUE_FRAMES);
+            printRegisters(&debugger);
+        }
+        else if (strcmp(command, "s") == 0)
+        {
+            run(&debugger, count > 1 ? strtoll(tokens[1], NULL, 10) : 1, UINT32_MAX);
+            printRegisters(&debugger);
+        }
+        else if (strcmp(command, "r") == 0)
+            printRegisters(&debugger);
+        else if (strcmp(command, "x") == 0 && count > 1)
+        {
+            const unsigned int length = count > 2 ? strtoul(tokens[2], NULL, 16) : 16;
+            for (unsigned int i = 0; i < length; i++)
+            {
+                if (i % 16 == 0)
+                    printf("%s%03X ", i ? "\n" : "", (address + i) & 0xFFF);
+                printf(" %02X", chip->memory[(address + i) & 0xFFF]);
+            }
+            printf("\n");
+        }
+        else if (strcmp(command, "l") == 0)
+        {
+            const unsigned int length = count > 2 ? strtoul(tokens[2], NULL, 10) : 8;
+            for (unsigned int i = 0; i < length; i++)
+                printInstruction(chip, address + 2 * i);
+        }
+        else if (strcmp(command, "k") == 0 && count > 1)
+            chip->keypad = (uint16_t)strtoul(tokens[1], NULL, 16);
+        else if (strcmp(command, "q") == 0)
+            break;
+        else
+            printf("Unknown command: %s\n", command);
+
+        printf("> ");
+        fflush(stdout);
+    }
+    return 0;
+}
@@ -0,0 +1,145 @@
+#include "display.h"
+
+// 16 Game Keys
+// 1 2 3 4
+// q w e r
+// a s d f
+// z x c v
+const SDL_Keycode keymap[16] = {
+    SDLK_1,
+    SDLK_2,
+    SDLK_3,
+    SDLK_4,
+    SDLK_q,
+    SDLK_w,
+    SDLK_e,
+    SDLK_r,
+    SDLK_a,
+    SDLK_s,
+    SDLK_d,
+    SDLK_f,
+    SDLK_z,
+    SDLK_x,
+    SDLK_c,
+    SDLK_v};
+
+#define PIXEL_ON 0xFFFFFFFF  // ARGB white
+#define PIXEL_OFF 0xFF000000 // ARGB black
+
+// Expands the framebuffer into the streaming texture, one texel per pixel
+void drawFrameBuffer(Display *display, const ChipContext *chip)
+{
+    void *texels;
+    int pitch;
+    if (SDL_LockTexture(display->texture, NULL, &texels, &pitch) != 0)
+    {
+        printf("Failed to lock texture: %s\n", SDL_GetError());
+        return;
+    }
+
+    for (int y = 0; y < DISPLAY_HEIGHT; y++)
+    {
+        uint32_t *row = (uint32_t *)((uint8_t *)texels + y * pitch);
+        const uint64_t pixels = chip->frameBuffer[y];
+        for (int x = 0; x < DISPLAY_WIDTH; x++)
+            row[x] = (pixels >> (DISPLAY_WIDTH - 1 - x)) & 1 ? PIXEL_ON : PIXEL_OFF;
+    }
+
+    SDL_UnlockTexture(display->texture);
+}
+
+// Scales the texture over the whole window and shows it
+void presentDisplay(Display *display)
+{
+    SDL_RenderCopy(display->renderer, display->texture, NULL, NULL);
+    SDL_RenderPresent(display->renderer);
+}
+
+// Applies a key event to a ChipContext::keypad style bitmask. Returns
+// nonzero if the key is on the keypad.
+int handleKeypadEvent(const SDL_Event *event, uint16_t *keypad)
+{
+    if (event->type != SDL_KEYDOWN && event->type != SDL_KEYUP)
+        return 0;
+
+    for (int i = 0; i < 16; i++)
+    {
+        if (event->key.keysym.sym == keymap[i])
+        {
+            if (event->type == SDL_KEYDOWN)
+                *keypad |= 1 << i;
+            else
+                *keypad &= ~(1 << i);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int initializeGraphics(Display *display, const int width, const int height)
+{
+
+    // Initialize the video subsystem
+    if (SDL_Init(SDL_INIT_VIDEO) < 0)
+    {
+        printf("SDL could not be initialized: %s\n", SDL_GetError());
+        return 1;
+    }
+    else
+    {
+        printf("SDL video system is ready to go\n");
+    }
+
+    // Create the window
+    display->window = SDL_CreateWindow("CHIP8",
+                                       SDL_WINDOWPOS_CENTERED,
+                                       SDL_WINDOWPOS_CENTERED,
+                                       width,
+                                       height,
+                                       SDL_WINDOW_SHOWN);
+    if (!display->window)
+    {
+        printf("Window could not be created: %s\n", SDL_GetError());
+        SDL_Quit();
+        return 1;
+    }
+
+    // Create the renderer
+    display->renderer = SDL_CreateRenderer(display->window, -1, SDL_RENDERER_SOFTWARE);
+    if (!display->renderer)
+    {
+        printf("Failed to create renderer: %s\n", SDL_GetError());
+        SDL_DestroyWindow(display->window);
+        SDL_Quit();
+        return 1;
+    }
+
+    // Create the texture the framebuffer is drawn into
+    display->texture = SDL_CreateTexture(display->renderer,
+                                         SDL_PIXELFORMAT_ARGB8888,
+                                         SDL_TEXTUREACCESS_STREAMING,
+                                         DISPLAY_WIDTH,
+                                         DISPLAY_HEIGHT);
+    if (!display->texture)
+    {
+        printf("Failed to create texture: %s\n", SDL_GetError());
+        SDL_DestroyRenderer(display->renderer);
+        SDL_DestroyWindow(display->window);
+        SDL_Quit();
+        return 1;
+    }
+
+    // Start with a blank screen
+    SDL_SetRenderDrawColor(display->renderer, 0, 0, 0, 255);
+    SDL_RenderClear(display->renderer);
+
+    return 0; // Success
+}
+
+void destroyGraphics(Display *display)
+{
+    SDL_DestroyTexture(display->texture);
+    SDL_DestroyRenderer(display->renderer);
+    SDL_DestroyWindow(display->window);
+    SDL_Quit();
+}
\ No newline at end of file
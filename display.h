@@ -0,0 +1,22 @@
+#ifndef DISPLAY_H
+#define DISPLAY_H
+
+#include "chip8.h"
+#include <SDL2/SDL.h>
+
+#define SCALE 10
+
+typedef struct Display
+{
+  SDL_Renderer *renderer;
+  SDL_Window *window;
+  SDL_Texture *texture; // DISPLAY_WIDTH x DISPLAY_HEIGHT, scaled to the window
+} Display;
+
+int initializeGraphics(Display *display, const int width, const int height);
+void destroyGraphics(Display *display);
+void drawFrameBuffer(Display *display, const ChipContext *chip);
+void presentDisplay(Display *display);
+int handleKeypadEvent(const SDL_Event *event, uint16_t *keypad);
+
+#endif // DISPLAY_H
@@ -0,0 +1,141 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "chip8.h"
+#include "movie.h"
+#include "sampler.h"
+#include <unistd.h>
+
+// Runs a ROM headless, replaying a movie if given, and samples the guest
+// call stack every few instructions. Prints folded stacks for flamegraph
+// tools, e.g. ./flame -y breakout.sym roms/breakout.ch8 | flamegraph.pl
+
+#define DEFAULT_INTERVAL 31 // Instructions, prime so loops don't alias with it
+#define DEFAULT_FRAMES (60 * TIMER_FREQUENCY)
+#define DEFAULT_INSTRUCTIONS_PER_FRAME 8
+
+// runFrame, stopping every interval instructions to take a sample
+static int runSampledFrame(ChipContext *chip, Sampler *sampler, const int instructionsPerFrame,
+                           const int interval, int *untilSample)
+{
+    int cycles = instructionsPerFrame;
+    while (cycles > 0)
+    {
+        int executed;
+        const enum cpuExit result = runCPU(chip, cycles < *untilSample ? cycles : *untilSample, &executed);
+        cycles -= executed;
+        *untilSample -= executed;
+
+        if (*untilSample == 0)
+        {
+            if (recordSample(sampler, chip) != 0)
+                return 1;
+            *untilSample = interval;
+        }
+
+        if (result == CPU_EXIT_KEY_WAIT)
+            break;
+        else if (result == CPU_EXIT_INVALID_OPCODE)
+        {
+            chip->PC += 2;
+            cycles--;
+        }
+    }
+
+    tickTimers(chip);
+    return 0;
+}
+
+static void printUsage(const char *program)
+{
+    printf("Usage: %s [-i interval] [-f frames] [-p instructions_per_frame] [-y symbol_file] [-a]\n"
+           "          <rom> [movie]\n",
+           program);
+}
+
+int main(int argc, char *argv[])
+{
+    int interval = DEFAULT_INTERVAL;
+    uint32_t frames = DEFAULT_FRAMES;
+    int instructionsPerFrame = DEFAULT_INSTRUCTIONS_PER_FRAME;
+    const char *symbolPath = NULL;
+    int withPC = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "i:f:p:y:a")) != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            interval = atoi(optarg);
+            break;
+        case 'f':
+            frames = (uint32_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            instructionsPerFrame = atoi(optarg);
+            break;
+        case 'y':
+            symbolPath = optarg;
+            break;
+        case 'a':
+            withPC = 1;
+            break;
+        default:
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc || interval <= 0 || instructionsPerFrame <= 0)
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    // ChipContext is too big for the stack
+    static ChipContext chip;
+    initializeChip(&chip);
+    if (loadROM(argv[optind], &chip) != 0)
+        return 1;
+
+    // A movie sets the seed, the speed, the length and the input
+    Movie movie;
+    const int playing = optind + 1 < argc;
+    if (playing)
+    {
+        if (loadMovie(&movie, argv[optind + 1]) != 0)
+            return 1;
+        if (movie.romHash != hashROM(&chip))
+        {
+            printf("Movie was recorded on a different ROM\n");
+            return 1;
+        }
+        seedRandom(&chip, movie.seed);
+        instructionsPerFrame = movie.instructionsPerFrame;
+        frames = movie.frameCount;
+    }
+
+    Sampler *sampler = createSampler(withPC);
+    if (!sampler || (symbolPath && loadSymbols(sampler, symbolPath) != 0))
+        return 1;
+
+    int untilSample = interval;
+    for (uint32_t frame = 0; frame < frames; frame++)
+    {
+        if (playing)
+            playMovieFrame(&movie, &chip.keypad);
+        if (runSampledFrame(&chip, sampler, instructionsPerFrame, interval, &untilSample) != 0)
+        {
+            printf("Out of memory\n");
+            return 1;
+        }
+    }
+
+    writeFoldedStacks(sampler, stdout);
+    fprintf(stderr, "%llu samples over %u frames, frame hash %016llx\n", (unsigned long long)sampleCount(sampler),
+            frames, (unsigned long long)hashFrameBuffer(&chip));
+
+    destroySampler(sampler);
+    if (playing)
+        freeMovie(&movie);
+    return 0;
+}
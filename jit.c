@@ -0,0 +1,792 @@
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS
+
+#include "jit.h"
+#include <stddef.h>
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#define JIT_NATIVE 1
+#include <sys/mman.h>
+#endif
+
+#define JIT_CODE_SIZE (1024 * 1024)
+#define JIT_MAX_BLOCK_INSTRUCTIONS 64
+#define JIT_MAX_INSTRUCTION_BYTES 176 // Including the budget check in front of it
+#define JIT_MAX_BLOCK_BYTES (JIT_MAX_BLOCK_INSTRUCTIONS * JIT_MAX_INSTRUCTION_BYTES + 16)
+
+enum blockState
+{
+    BLOCK_UNTRANSLATED,
+    BLOCK_NATIVE,     // Run code, then continue at whatever PC it stored
+    BLOCK_INTERPRETED // At the last byte of memory, with no room for a block
+};
+
+// Runs at most cycles instructions of the block, at least one, and returns
+// the part of cycles left over
+typedef int (*BlockFunction)(ChipContext *chip, int cycles);
+
+typedef struct JitBlock
+{
+    BlockFunction code;
+    uint16_t end;  // First guest address after the translated bytes
+    uint8_t state; // enum blockState
+} JitBlock;
+
+struct JitContext
+{
+    uint8_t *code;
+    size_t codeUsed;
+    JitBlock blocks[MEMORY_SIZE];
+    DecodedInstruction ops[MEMORY_SIZE]; // Operands of the handlers blocks call
+    uint8_t translated[MEMORY_SIZE];     // Nonzero where a native block may cover the byte
+    uint16_t translatedLow;              // Every translated byte is in [low, high)
+    uint16_t translatedHigh;
+};
+
+#ifdef JIT_NATIVE
+
+// Registers used by the generated code. The ChipContext pointer stays in RDI
+// and the cycle budget in ESI, the first two argument registers of the
+// System V calling convention.
+enum x86Register
+{
+    EAX = 0,
+    ECX = 1,
+    EDX = 2,
+    ESI = 6
+};
+
+// x86 condition codes for SETcc
+enum x86Condition
+{
+    COND_B = 0x2, // Carry set
+    COND_E = 0x4,
+    COND_NE = 0x5,
+    COND_A = 0x7
+};
+
+typedef struct Emitter
+{
+    uint8_t *cursor;
+} Emitter;
+
+enum emitResult
+{
+    EMIT_CONTINUE,   // Block carries on with the next instruction
+    EMIT_END,        // Instruction set PC itself, block ends after it
+    EMIT_UNSUPPORTED // Nothing emitted, the block calls the interpreter's handler
+};
+
+#define V_OFFSET(reg) ((int32_t)(offsetof(ChipContext, V) + (reg)))
+#define PC_OFFSET ((int32_t)offsetof(ChipContext, PC))
+#define I_OFFSET ((int32_t)offsetof(ChipContext, I))
+#define SP_OFFSET ((int32_t)offsetof(ChipContext, SP))
+#define STACK_OFFSET ((int32_t)offsetof(ChipContext, stack))
+#define DELAY_OFFSET ((int32_t)offsetof(ChipContext, delayTimer))
+#define SOUND_OFFSET ((int32_t)offsetof(ChipContext, soundTimer))
+#define MEMORY_OFFSET ((int32_t)offsetof(ChipContext, memory))
+
+static void emit8(Emitter *e, const uint8_t value)
+{
+    *e->cursor++ = value;
+}
+
+static void emit16(Emitter *e, const uint16_t value)
+{
+    emit8(e, value & 0xFF);
+    emit8(e, value >> 8);
+}
+
+static void emit32(Emitter *e, const uint32_t value)
+{
+    emit16(e, value & 0xFFFF);
+    emit16(e, value >> 16);
+}
+
+static void emit64(Emitter *e, const uint64_t value)
+{
+    emit32(e, value & 0xFFFFFFFF);
+    emit32(e, value >> 32);
+}
+
+// ModRM for [rdi + disp32] with reg (or an opcode extension) in the middle field
+static void emitContextOperand(Emitter *e, const uint8_t reg, const int32_t offset)
+{
+    emit8(e, 0x80 | (reg << 3) | 7);
+    emit32(e, (uint32_t)offset);
+}
+
+static void emitLoadByte(Emitter *e, const uint8_t reg, const int32_t offset)
+{
+    // movzx reg32, byte [rdi + offset]
+    emit8(e, 0x0F);
+    emit8(e, 0xB6);
+    emitContextOperand(e, reg, offset);
+}
+
+static void emitStoreByte(Emitter *e, const uint8_t reg, const int32_t offset)
+{
+    // mov byte [rdi + offset], reg8
+    emit8(e, 0x88);
+    emitContextOperand(e, reg, offset);
+}
+
+static void emitStoreByteImmediate(Emitter *e, const int32_t offset, const uint8_t value)
+{
+    // mov byte [rdi + offset], imm8
+    emit8(e, 0xC6);
+    emitContextOperand(e, 0, offset);
+    emit8(e, value);
+}
+
+static void emitAddByteImmediate(Emitter *e, const int32_t offset, const uint8_t value)
+{
+    // add byte [rdi + offset], imm8
+    emit8(e, 0x80);
+    emitContextOperand(e, 0, offset);
+    emit8(e, value);
+}
+
+static void emitStoreWord(Emitter *e, const uint8_t reg, const int32_t offset)
+{
+    // mov word [rdi + offset], reg16
+    emit8(e, 0x66);
+    emit8(e, 0x89);
+    emitContextOperand(e, reg, offset);
+}
+
+static void emitStoreWordImmediate(Emitter *e, const int32_t offset, const uint16_t value)
+{
+    // mov word [rdi + offset], imm16
+    emit8(e, 0x66);
+    emit8(e, 0xC7);
+    emitContextOperand(e, 0, offset);
+    emit16(e, value);
+}
+
+static void emitAluByte(Emitter *e, const uint8_t opcode, const uint8_t dst, const uint8_t src)
+{
+    // <op> dst8, src8 using the r/m8, r8 form (00 ADD, 08 OR, 20 AND, 28 SUB, 30 XOR, 38 CMP)
+    emit8(e, opcode);
+    emit8(e, 0xC0 | (src << 3) | dst);
+}
+
+static void emitSetFlag(Emitter *e, const uint8_t condition)
+{
+    // setcc dl
+    emit8(e, 0x0F);
+    emit8(e, 0x90 | condition);
+    emit8(e, 0xC2);
+}
+
+// Stores PC = nextPC, or nextPC + 2 when the condition holds
+static void emitSkip(Emitter *e, const uint8_t condition, const uint16_t nextPC)
+{
+    emitSetFlag(e, condition);
+    emit8(e, 0x0F); // movzx edx, dl
+    emit8(e, 0xB6);
+    emit8(e, 0xD2);
+    emit8(e, 0x01); // add edx, edx
+    emit8(e, 0xD2);
+    emit8(e, 0x81); // add edx, imm32
+    emit8(e, 0xC2);
+    emit32(e, nextPC);
+    emitStoreWord(e, EDX, PC_OFFSET);
+}
+
+// Copies length bytes from memory[I] to V[0] onwards, in moves of 8, 4, 2
+// and 1 bytes. Like the interpreter, a copy that runs past 0xFFF wraps to 0,
+// which is done a byte at a time.
+static void emitLoadRegisters(Emitter *e, const int length)
+{
+    emit8(e, 0x0F); // movzx eax, word [I]
+    emit8(e, 0xB7);
+    emitContextOperand(e, EAX, I_OFFSET);
+    emit8(e, 0x25); // and eax, 0xFFF
+    emit32(e, 0xFFF);
+    emit8(e, 0x3D); // cmp eax, MEMORY_SIZE - length
+    emit32(e, (uint32_t)(MEMORY_SIZE - length));
+    emit8(e, 0x77); // ja to the wrapping copy
+    uint8_t *wrapping = e->cursor++;
+
+    int copied = 0;
+    int size = 8;
+    while (copied < length)
+    {
+        if (length - copied < size)
+        {
+            size /= 2;
+            continue;
+        }
+
+        // mov rcx/ecx/cx/cl, [rdi + rax + memory + copied]
+        if (size == 8)
+            emit8(e, 0x48);
+        else if (size == 2)
+            emit8(e, 0x66);
+        emit8(e, size == 1 ? 0x8A : 0x8B);
+        emit8(e, 0x8C);
+        emit8(e, 0x07);
+        emit32(e, (uint32_t)(MEMORY_OFFSET + copied));
+
+        // mov [rdi + V + copied], rcx/ecx/cx/cl
+        if (size == 8)
+            emit8(e, 0x48);
+        else if (size == 2)
+            emit8(e, 0x66);
+        emit8(e, size == 1 ? 0x88 : 0x89);
+        emitContextOperand(e, ECX, V_OFFSET(copied));
+        copied += size;
+    }
+    emit8(e, 0xEB); // jmp over the wrapping copy
+    uint8_t *over = e->cursor++;
+
+    *wrapping = (uint8_t)(e->cursor - wrapping - 1);
+    emit8(e, 0x31); // xor edx, edx
+    emit8(e, 0xD2);
+    uint8_t *loop = e->cursor;
+    emit8(e, 0x0F); // movzx ecx, byte [rdi + rax + memory]
+    emit8(e, 0xB6);
+    emit8(e, 0x8C);
+    emit8(e, 0x07);
+    emit32(e, (uint32_t)MEMORY_OFFSET);
+    emit8(e, 0x88); // mov [rdi + rdx + V], cl
+    emit8(e, 0x8C);
+    emit8(e, 0x17);
+    emit32(e, (uint32_t)V_OFFSET(0));
+    emit8(e, 0xFF); // inc eax
+    emit8(e, 0xC0);
+    emit8(e, 0x25); // and eax, 0xFFF
+    emit32(e, 0xFFF);
+    emit8(e, 0xFF); // inc edx
+    emit8(e, 0xC2);
+    emit8(e, 0x83); // cmp edx, length
+    emit8(e, 0xFA);
+    emit8(e, (uint8_t)length);
+    emit8(e, 0x72); // jb to the next byte
+    emit8(e, (uint8_t)(loop - (e->cursor + 1)));
+    *over = (uint8_t)(e->cursor - over - 1);
+}
+
+static void emitStackIndex(Emitter *e)
+{
+    // movzx eax, byte [SP]; and eax, 0xF
+    emitLoadByte(e, EAX, SP_OFFSET);
+    emit8(e, 0x83);
+    emit8(e, 0xE0);
+    emit8(e, 0x0F);
+}
+
+// Returns from the block with the budget left after the current instruction
+static void emitReturnRemaining(Emitter *e)
+{
+    emit8(e, 0x8D); // lea eax, [rsi - 1]
+    emit8(e, 0x40 | ESI);
+    emit8(e, 0xFF);
+    emit8(e, 0xC3); // ret
+}
+
+// Counts off the instruction before this one and, if that used up the budget,
+// leaves the block with PC at this one
+static void emitBudgetCheck(Emitter *e, const uint16_t address)
+{
+    emit8(e, 0xFF); // dec esi
+    emit8(e, 0xC8 | ESI);
+    emit8(e, 0x75); // jnz over the exit
+    emit8(e, 12);
+    emitStoreWordImmediate(e, PC_OFFSET, address);
+    emit8(e, 0x31); // xor eax, eax
+    emit8(e, 0xC0);
+    emit8(e, 0xC3); // ret
+}
+
+static enum emitResult emitInstruction(Emitter *e, const DecodedInstruction *op, const uint16_t address)
+{
+    const uint16_t nextPC = address + 2;
+
+    switch (op->opcode)
+    {
+
+    case OP_RET: // 00EE
+        emit8(e, 0xFE); // dec byte [SP]
+        emitContextOperand(e, 1, SP_OFFSET);
+        emitStackIndex(e);
+        emit8(e, 0x0F); // movzx ecx, word [rdi + rax * 2 + stack]
+        emit8(e, 0xB7);
+        emit8(e, 0x8C);
+        emit8(e, 0x47);
+        emit32(e, (uint32_t)STACK_OFFSET);
+        emitStoreWord(e, ECX, PC_OFFSET);
+        return EMIT_END;
+
+    case OP_JP: // 1nnn
+        emitStoreWordImmediate(e, PC_OFFSET, op->nnn);
+        return EMIT_END;
+
+    case OP_CALL: // 2nnn
+        emitStackIndex(e);
+        emit8(e, 0x66); // mov word [rdi + rax * 2 + stack], nextPC
+        emit8(e, 0xC7);
+        emit8(e, 0x84);
+        emit8(e, 0x47);
+        emit32(e, (uint32_t)STACK_OFFSET);
+        emit16(e, nextPC);
+        emit8(e, 0xFE); // inc byte [SP]
+        emitContextOperand(e, 0, SP_OFFSET);
+        emitStoreWordImmediate(e, PC_OFFSET, op->nnn);
+        return EMIT_END;
+
+    case OP_SE_BYTE: // 3xkk
+    case OP_SNE_BYTE: // 4xkk
+        emitLoadByte(e, EAX, V_OFFSET(op->x));
+        emit8(e, 0x3C); // cmp al, imm8
+        emit8(e, op->kk);
+        emitSkip(e, op->opcode == OP_SE_BYTE ? COND_E : COND_NE, nextPC);
+        return EMIT_END;
+
+    case OP_SE_REG: // 5xy0
+    case OP_SNE_REG: // 9xy0
+        emitLoadByte(e, EAX, V_OFFSET(op->x));
+        emit8(e, 0x3A); // cmp al, byte [Vy]
+        emitContextOperand(e, EAX, V_OFFSET(op->y));
+        emitSkip(e, op->opcode == OP_SE_REG ? COND_E : COND_NE, nextPC);
+        return EMIT_END;
+
+    case OP_LD_BYTE: // 6xkk
+        emitStoreByteImmediate(e, V_OFFSET(op->x), op->kk);
+        return EMIT_CONTINUE;
+
+    case OP_ADD_BYTE: // 7xkk
+        emitAddByteImmediate(e, V_OFFSET(op->x), op->kk);
+        return EMIT_CONTINUE;
+
+    case OP_LD_REG: // 8xy0
+        emitLoadByte(e, ECX, V_OFFSET(op->y));
+        emitStoreByte(e, ECX, V_OFFSET(op->x));
+        return EMIT_CONTINUE;
+
+    case OP_OR:  // 8xy1
+    case OP_AND: // 8xy2
+    case OP_XOR: // 8xy3
+        emitLoadByte(e, EAX, V_OFFSET(op->x));
+        emitLoadByte(e, ECX, V_OFFSET(op->y));
+        emitAluByte(e, op->opcode == OP_OR ? 0x08 : op->opcode == OP_AND ? 0x20 : 0x30, EAX, ECX);
+        emitStoreByte(e, EAX, V_OFFSET(op->x));
+        return EMIT_CONTINUE;
+
+    case OP_ADD_REG: // 8xy4
+        emitLoadByte(e, EAX, V_OFFSET(op->x));
+        emitLoadByte(e, ECX, V_OFFSET(op->y));
+        emitAluByte(e, 0x00, EAX, ECX);
+        emitSetFlag(e, COND_B);
+        emitStoreByte(e, EAX, V_OFFSET(op->x));
+        emitStoreByte(e, EDX, V_OFFSET(0xF));
+        return EMIT_CONTINUE;
+
+    // The flag is written before the result, so the result reloads its
+    // operands in case one of them is VF (same order as the interpreter)
+
+    case OP_SUB: // 8xy5
+        emitLoadByte(e, EAX, V_OFFSET(op->x));
+        emitLoadByte(e, ECX, V_OFFSET(op->y));
+        emitAluByte(e, 0x38, EAX, ECX);
+        emitSetFlag(e, COND_A);
+        emitStoreByte(e, EDX, V_OFFSET(0xF));
+        emitLoadByte(e, EAX, V_OFFSET(op->x));
+        emitLoadByte(e, ECX, V_OFFSET(op->y));
+        emitAluByte(e, 0x28, EAX, ECX);
+        emitStoreByte(e, EAX, V_OFFSET(op->x));
+        return EMIT_CONTINUE;
+
+    case OP_SHR: // 8xy6
+        emitLoadByte(e, EDX, V_OFFSET(op->x));
+        emit8(e, 0x80); // and dl, 1
+        emit8(e, 0xE2);
+        emit8(e, 0x01);
+        emitStoreByte(e, EDX, V_OFFSET(0xF));
+        emitLoadByte(e, EAX, V_OFFSET(op->x));
+        emit8(e, 0xD0); // shr al, 1
+        emit8(e, 0xE8);
+        emitStoreByte(e, EAX, V_OFFSET(op->x));
+        return EMIT_CONTINUE;
+
+    case OP_SUBN: // 8xy7
+        emitLoadByte(e, EAX, V_OFFSET(op->x));
+        emitLoadByte(e, ECX, V_OFFSET(op->y));
+        emitAluByte(e, 0x38, ECX, EAX);
+        emitSetFlag(e, COND_A);
+        emitStoreByte(e, EDX, V_OFFSET(0xF));
+        emitLoadByte(e, EAX, V_OFFSET(op->x));
+        emitLoadByte(e, ECX, V_OFFSET(op->y));
+        emitAluByte(e, 0x28, ECX, EAX);
+        emitStoreByte(e, ECX, V_OFFSET(op->x));
+        return EMIT_CONTINUE;
+
+    case OP_SHL: // 8xyE
+        emitLoadByte(e, EDX, V_OFFSET(op->x));
+        emit8(e, 0xC0); // shr dl, 7
+        emit8(e, 0xEA);
+        emit8(e, 0x07);
+        emitStoreByte(e, EDX, V_OFFSET(0xF));
+        emitLoadByte(e, EAX, V_OFFSET(op->x));
+        emit8(e, 0xD0); // shl al, 1
+        emit8(e, 0xE0);
+        emitStoreByte(e, EAX, V_OFFSET(op->x));
+        return EMIT_CONTINUE;
+
+    case OP_LD_I: // Annn
+        emitStoreWordImmediate(e, I_OFFSET, op->nnn);
+        return EMIT_CONTINUE;
+
+    case OP_JP_V0: // Bnnn
+        emitLoadByte(e, EAX, V_OFFSET(0));
+        emit8(e, 0x05); // add eax, imm32
+        emit32(e, op->nnn);
+        emitStoreWord(e, EAX, PC_OFFSET);
+        return EMIT_END;
+
+    case OP_LD_VX_DT: // Fx07
+        emitLoadByte(e, EAX, DELAY_OFFSET);
+        emitStoreByte(e, EAX, V_OFFSET(op->x));
+        return EMIT_CONTINUE;
+
+    case OP_LD_DT_VX: // Fx15
+        emitLoadByte(e, EAX, V_OFFSET(op->x));
+        emitStoreByte(e, EAX, DELAY_OFFSET);
+        return EMIT_CONTINUE;
+
+    case OP_LD_ST_VX: // Fx18
+        emitLoadByte(e, EAX, V_OFFSET(op->x));
+        emitStoreByte(e, EAX, SOUND_OFFSET);
+        return EMIT_CONTINUE;
+
+    case OP_ADD_I_VX: // Fx1E
+        emitLoadByte(e, EAX, V_OFFSET(op->x));
+        emit8(e, 0x66); // add word [I], ax
+        emit8(e, 0x01);
+        emitContextOperand(e, EAX, I_OFFSET);
+        return EMIT_CONTINUE;
+
+    case OP_LD_F_VX: // Fx29
+        emitLoadByte(e, EAX, V_OFFSET(op->x));
+        emit8(e, 0x8D); // lea eax, [rax + rax * 4]
+        emit8(e, 0x04);
+        emit8(e, 0x80);
+        emitStoreWord(e, EAX, I_OFFSET);
+        return EMIT_CONTINUE;
+
+    case OP_LD_VX_MEM: // Fx65
+        emitLoadRegisters(e, op->x + 1);
+        return EMIT_CONTINUE;
+
+    default:
+        return EMIT_UNSUPPORTED;
+    }
+}
+
+// Forgets every block that translated one of the written bytes, returning
+// nonzero if there were any. Most stores hit data, which no block covers, so
+// only those look for the blocks.
+static int invalidateJitRange(JitContext *jit, uint16_t address, const int length)
+{
+    // A store past 0xFFF wraps to 0, as the interpreter's do
+    address &= 0xFFF;
+    if (address + length > MEMORY_SIZE)
+        return invalidateJitRange(jit, address, MEMORY_SIZE - address) |
+               invalidateJitRange(jit, 0, address + length - MEMORY_SIZE);
+
+    if (address >= jit->translatedHigh || address + length <= jit->translatedLow)
+        return 0;
+
+    int covered = 0;
+    for (int i = 0; i < length; i++)
+        covered |= jit->translated[address + i];
+    if (!covered)
+        return 0;
+
+    const int first = address - JIT_MAX_BLOCK_INSTRUCTIONS * 2;
+    for (int start = first < 0 ? 0 : first; start < address + length && start < MEMORY_SIZE; start++)
+    {
+        JitBlock *block = &jit->blocks[start];
+        if (block->state != BLOCK_UNTRANSLATED && block->end > address)
+            block->state = BLOCK_UNTRANSLATED;
+    }
+    return 1;
+}
+
+// Runs an instruction the JIT does not translate on the interpreter's
+// handler, with PC already past it. Returns nonzero if the block has to stop
+// after it: the instruction skipped or waited for a key, or it wrote over
+// translated code.
+static int interpretInstruction(ChipContext *chip, const DecodedInstruction *op, JitContext *jit)
+{
+    const uint16_t nextPC = chip->PC;
+    const uint16_t writeAddress = chip->I;
+    int writeLength = 0;
+    if (op->opcode == OP_LD_B_VX)
+        writeLength = 3;
+    else if (op->opcode == OP_LD_MEM_VX)
+        writeLength = op->x + 1;
+
+    // Unknown instructions are skipped, as executeCPUCycles does
+    if (executeDecoded(chip, op) == CPU_EXIT_INVALID_OPCODE)
+        chip->PC += 2;
+
+    return chip->PC != nextPC || (writeLength && invalidateJitRange(jit, writeAddress, writeLength));
+}
+
+// Called by a store that wrote near translated code, with I still where it
+// wrote
+static void invalidateStore(ChipContext *chip, const DecodedInstruction *op, JitContext *jit)
+{
+    invalidateJitRange(jit, chip->I, op->opcode == OP_LD_B_VX ? 3 : op->x + 1);
+}
+
+// Calls function(chip, op, jit) with the block's own registers saved
+static void emitHelperCall(Emitter *e, JitContext *jit, const DecodedInstruction *op, const uintptr_t function)
+{
+    emit8(e, 0x57); // push rdi
+    emit8(e, 0x56); // push rsi
+    emit8(e, 0x48); // sub rsp, 8, aligning the stack for the call
+    emit8(e, 0x83);
+    emit8(e, 0xEC);
+    emit8(e, 0x08);
+    emit8(e, 0x48); // mov rsi, op
+    emit8(e, 0xB8 | ESI);
+    emit64(e, (uintptr_t)op);
+    emit8(e, 0x48); // mov rdx, jit
+    emit8(e, 0xB8 | EDX);
+    emit64(e, (uintptr_t)jit);
+    emit8(e, 0x48); // mov rax, function
+    emit8(e, 0xB8 | EAX);
+    emit64(e, function);
+    emit8(e, 0xFF); // call rax
+    emit8(e, 0xD0);
+    emit8(e, 0x48); // add rsp, 8
+    emit8(e, 0x83);
+    emit8(e, 0xC4);
+    emit8(e, 0x08);
+    emit8(e, 0x5E); // pop rsi
+    emit8(e, 0x5F); // pop rdi
+}
+
+// After Fx33 or Fx55 wrote length bytes at I: if they may have hit
+// translated code, forgets it and leaves the block. A store that wrapped past
+// 0xFFF always takes the slow way.
+static void emitStoreCheck(Emitter *e, JitContext *jit, const DecodedInstruction *op, const uint16_t address,
+                           const uint8_t length)
+{
+    const uint8_t highOffset = offsetof(JitContext, translatedHigh) - offsetof(JitContext, translatedLow);
+
+    emit8(e, 0x0F); // movzx eax, word [I]
+    emit8(e, 0xB7);
+    emitContextOperand(e, EAX, I_OFFSET);
+    emit8(e, 0x25); // and eax, 0xFFF
+    emit32(e, 0xFFF);
+    emit8(e, 0x3D); // cmp eax, MEMORY_SIZE - length
+    emit32(e, (uint32_t)(MEMORY_SIZE - length));
+    emit8(e, 0x77); // ja to the exit
+    uint8_t *wrapped = e->cursor++;
+    emit8(e, 0x48); // mov rdx, &translatedLow
+    emit8(e, 0xB8 | EDX);
+    emit64(e, (uintptr_t)&jit->translatedLow);
+    emit8(e, 0x0F); // movzx ecx, word [rdx + high]
+    emit8(e, 0xB7);
+    emit8(e, 0x4A);
+    emit8(e, highOffset);
+    emit8(e, 0x39); // cmp eax, ecx
+    emit8(e, 0xC8);
+    emit8(e, 0x73); // jae over the exit
+    uint8_t *overHigh = e->cursor++;
+    emit8(e, 0x0F); // movzx ecx, word [rdx]
+    emit8(e, 0xB7);
+    emit8(e, 0x0A);
+    emit8(e, 0x83); // add eax, length
+    emit8(e, 0xC0);
+    emit8(e, length);
+    emit8(e, 0x39); // cmp eax, ecx
+    emit8(e, 0xC8);
+    emit8(e, 0x76); // jbe over the exit
+    uint8_t *overLow = e->cursor++;
+
+    *wrapped = (uint8_t)(e->cursor - wrapped - 1);
+    emitStoreWordImmediate(e, PC_OFFSET, address + 2);
+    emitHelperCall(e, jit, op, (uintptr_t)invalidateStore);
+    emitReturnRemaining(e);
+
+    *overHigh = (uint8_t)(e->cursor - overHigh - 1);
+    *overLow = (uint8_t)(e->cursor - overLow - 1);
+}
+
+// Calls the interpreter for the instruction at address. Drawing, clearing
+// the screen and random numbers can neither jump nor write memory, so they
+// go straight to executeDecoded, as do the stores with a check of what they
+// wrote. Everything else goes through interpretInstruction and leaves the
+// block if it asks to.
+static void emitInterpreterCall(Emitter *e, JitContext *jit, const DecodedInstruction *op, const uint16_t address)
+{
+    DecodedInstruction *saved = &jit->ops[address];
+    *saved = *op;
+
+    switch (op->opcode)
+    {
+    case OP_CLS:
+    case OP_RND:
+    case OP_DRW:
+        emitHelperCall(e, jit, saved, (uintptr_t)executeDecoded);
+        break;
+
+    case OP_LD_B_VX:
+    case OP_LD_MEM_VX:
+        emitHelperCall(e, jit, saved, (uintptr_t)executeDecoded);
+        emitStoreCheck(e, jit, saved, address, op->opcode == OP_LD_B_VX ? 3 : op->x + 1);
+        break;
+
+    default:
+        emitStoreWordImmediate(e, PC_OFFSET, address + 2);
+        emitHelperCall(e, jit, saved, (uintptr_t)interpretInstruction);
+        emit8(e, 0x85); // test eax, eax
+        emit8(e, 0xC0);
+        emit8(e, 0x74); // jz over the exit
+        emit8(e, 4);
+        emitReturnRemaining(e);
+        break;
+    }
+}
+
+static void translateBlock(JitContext *jit, const ChipContext *chip, const uint16_t address)
+{
+    JitBlock *block = &jit->blocks[address];
+
+    if (address + 1 >= MEMORY_SIZE)
+    {
+        block->state = BLOCK_INTERPRETED;
+        block->end = address + 2;
+        return;
+    }
+
+    if (jit->codeUsed + JIT_MAX_BLOCK_BYTES > JIT_CODE_SIZE)
+        flushJit(jit);
+
+    mprotect(jit->code, JIT_CODE_SIZE, PROT_READ | PROT_WRITE);
+
+    uint8_t *start = jit->code + jit->codeUsed;
+    Emitter e = {start};
+    uint16_t pc = address;
+    uint16_t length = 0;
+    enum emitResult result = EMIT_CONTINUE;
+
+    while (result == EMIT_CONTINUE && length < JIT_MAX_BLOCK_INSTRUCTIONS && pc + 1 < MEMORY_SIZE)
+    {
+        DecodedInstruction op;
+        decodeInstruction((chip->memory[pc] << 8) | chip->memory[pc + 1], &op);
+
+        // The block can stop in front of any instruction but the first, so
+        // it never runs past the caller's budget
+        if (length > 0)
+            emitBudgetCheck(&e, pc);
+        result = emitInstruction(&e, &op, pc);
+        if (result == EMIT_UNSUPPORTED)
+        {
+            emitInterpreterCall(&e, jit, &op, pc);
+            result = EMIT_CONTINUE;
+        }
+
+        length++;
+        pc += 2;
+    }
+
+    if (result != EMIT_END)
+        emitStoreWordImmediate(&e, PC_OFFSET, pc);
+    emitReturnRemaining(&e);
+
+    block->state = BLOCK_NATIVE;
+    block->code = (BlockFunction)start;
+    block->end = pc;
+    memset(&jit->translated[address], 1, pc - address);
+    if (address < jit->translatedLow)
+        jit->translatedLow = address;
+    if (pc > jit->translatedHigh)
+        jit->translatedHigh = pc;
+    jit->codeUsed = (e.cursor - jit->code + 15) & ~(size_t)15;
+
+    mprotect(jit->code, JIT_CODE_SIZE, PROT_READ | PROT_EXEC);
+}
+
+#endif // JIT_NATIVE
+
+JitContext *createJit(void)
+{
+    JitContext *jit = calloc(1, sizeof(JitContext));
+    if (!jit)
+        return NULL;
+    jit->translatedLow = MEMORY_SIZE;
+
+#ifdef JIT_NATIVE
+    jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->code == MAP_FAILED)
+    {
+        printf("Failed to allocate JIT code buffer, using the interpreter.\n");
+        jit->code = NULL;
+    }
+#endif
+
+    return jit;
+}
+
+void destroyJit(JitContext *jit)
+{
+    if (!jit)
+        return;
+
+#ifdef JIT_NATIVE
+    if (jit->code)
+        munmap(jit->code, JIT_CODE_SIZE);
+#endif
+    free(jit);
+}
+
+// Drops all translations. Needed after memory is changed outside of the
+// guest's own stores, e.g. by loadROM.
+void flushJit(JitContext *jit)
+{
+    memset(jit->blocks, 0, sizeof(jit->blocks)); // BLOCK_UNTRANSLATED
+    memset(jit->translated, 0, sizeof(jit->translated));
+    jit->translatedLow = MEMORY_SIZE;
+    jit->translatedHigh = 0;
+    jit->codeUsed = 0;
+}
+
+void executeJitCycles(JitContext *jit, ChipContext *chip, int cycles)
+{
+#ifdef JIT_NATIVE
+    if (!jit->code)
+    {
+        executeCPUCycles(chip, cycles);
+        return;
+    }
+
+    while (cycles > 0)
+    {
+        const uint16_t address = chip->PC & 0xFFF;
+        JitBlock *block = &jit->blocks[address];
+
+        if (block->state == BLOCK_UNTRANSLATED)
+            translateBlock(jit, chip, address);
+
+        if (block->state == BLOCK_NATIVE)
+        {
+            cycles = block->code(chip, cycles);
+            continue;
+        }
+
+        // An instruction split across the end of memory
+        DecodedInstruction op;
+        decodeInstruction((chip->memory[address] << 8) | chip->memory[(address + 1) & 0xFFF], &op);
+        chip->PC += 2;
+        interpretInstruction(chip, &op, jit);
+        cycles--;
+    }
+#else
+    executeCPUCycles(chip, cycles);
+#endif
+}
@@ -0,0 +1,19 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "chip8.h"
+
+// Translates straight-line runs of CHIP-8 instructions into native x86-64
+// code. Instructions the JIT does not translate (drawing, input, memory
+// stores, random numbers) call the interpreter's handler from inside the
+// block. A block stops early when the cycle budget runs out, so frames of
+// any length stay in native code. On other hosts every instruction runs on
+// the interpreter.
+typedef struct JitContext JitContext;
+
+JitContext *createJit(void);
+void destroyJit(JitContext *jit);
+void flushJit(JitContext *jit);
+void executeJitCycles(JitContext *jit, ChipContext *chip, int cycles);
+
+#endif // JIT_H
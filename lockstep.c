@@ -0,0 +1,542 @@
+#include "lockstep.h"
+
+// Every lane executes the same number of instructions per run, and each one
+// ends up in the same state it would reach running alone on the interpreter.
+//
+// Lanes are kept in groups at the same PC on the same instruction. Each
+// step runs every group's instruction once over its lanes, and a group of
+// all the lanes does so in one loop the compiler vectorizes. Groups too
+// small to gain from that run their lanes one at a time through the rest
+// of the run instead, then rejoin any group they caught up with. The groups
+// only change when an instruction sends lanes of one group to different
+// PCs, when lanes' memory holds different instructions at the same PC, or
+// when a jump lands a group on another group's PC.
+
+// Smaller groups run one lane at a time
+#define MIN_GROUP_LANES 4
+
+#define FOR_EACH_LANE(lane) for (int lane = 0; lane < LOCKSTEP_LANES; lane++)
+
+// Runs the statement after it once per lane in the group: over every lane
+// when the group has them all, so the loop vectorizes, and otherwise over
+// the group's own lanes
+#define FOR_EACH_MEMBER(lane, ...)                     \
+    if (count == LOCKSTEP_LANES)                       \
+    {                                                  \
+        FOR_EACH_LANE(lane)                            \
+        __VA_ARGS__                                    \
+    }                                                  \
+    else                                               \
+    {                                                  \
+        for (int member = 0; member < count; member++) \
+        {                                              \
+            const int lane = members[member];          \
+            __VA_ARGS__                                \
+        }                                              \
+    }
+
+// Lowest and highest group in a bitmask of groups, which must not be zero
+static inline int lowestGroup(const uint32_t groups)
+{
+#if defined(__GNUC__)
+    return __builtin_ctz(groups);
+#else
+    int group = 0;
+    while (!(groups & (1u << group)))
+        group++;
+    return group;
+#endif
+}
+
+static inline int highestGroup(const uint32_t groups)
+{
+#if defined(__GNUC__)
+    return 31 - __builtin_clz(groups);
+#else
+    int group = 31;
+    while (!(groups & (1u << group)))
+        group--;
+    return group;
+#endif
+}
+
+void loadLane(LockstepContext *lanes, const int lane, const ChipContext *chip)
+{
+    for (int i = 0; i < 16; i++)
+    {
+        lanes->V[i][lane] = chip->V[i];
+        lanes->stack[i][lane] = chip->stack[i];
+    }
+    for (int y = 0; y < DISPLAY_HEIGHT; y++)
+        lanes->frameBuffer[y][lane] = chip->frameBuffer[y];
+
+    lanes->I[lane] = chip->I;
+    lanes->PC[lane] = chip->PC;
+    lanes->SP[lane] = chip->SP;
+    lanes->delayTimer[lane] = chip->delayTimer;
+    lanes->soundTimer[lane] = chip->soundTimer;
+    lanes->keypad[lane] = chip->keypad;
+    lanes->rngState[lane] = chip->rngState;
+    memcpy(lanes->memory[lane], chip->memory, MEMORY_SIZE);
+    lanes->groupCount = 0; // Regroup on the next run
+}
+
+void storeLane(const LockstepContext *lanes, const int lane, ChipContext *chip)
+{
+    for (int i = 0; i < 16; i++)
+    {
+        chip->V[i] = lanes->V[i][lane];
+        chip->stack[i] = lanes->stack[i][lane];
+    }
+    for (int y = 0; y < DISPLAY_HEIGHT; y++)
+        chip->frameBuffer[y] = lanes->frameBuffer[y][lane];
+
+    chip->I = lanes->I[lane];
+    chip->PC = lanes->PC[lane];
+    chip->SP = lanes->SP[lane];
+    chip->delayTimer = lanes->delayTimer[lane];
+    chip->soundTimer = lanes->soundTimer[lane];
+    chip->keypad = lanes->keypad[lane];
+    chip->rngState = lanes->rngState[lane];
+    memcpy(chip->memory, lanes->memory[lane], MEMORY_SIZE);
+    invalidateDecoded(chip, 0, MEMORY_SIZE);
+    chip->memoryLow = 0; // Lanes don't track what they wrote
+    chip->memoryHigh = MEMORY_SIZE;
+}
+
+static inline uint16_t fetchInstruction(const LockstepContext *lanes, const int lane, const uint16_t address)
+{
+    return (lanes->memory[lane][address] << 8) | lanes->memory[lane][(address + 1) & 0xFFF];
+}
+
+// Decodes through a cache shared by the lanes, checked against the
+// instruction since each lane has its own memory
+static inline const DecodedInstruction *decodeCached(LockstepContext *lanes, const uint16_t address,
+                                                      const uint16_t instruction)
+{
+    DecodedInstruction *op = &lanes->decoded[address];
+    if (op->opcode == OP_UNDECODED || lanes->decodedWord[address] != instruction)
+    {
+        decodeInstruction(instruction, op);
+        lanes->decodedWord[address] = instruction;
+    }
+    return op;
+}
+
+// Instructions after which lanes of one group may be at different PCs
+static inline int mayDiverge(const uint8_t opcode)
+{
+    switch (opcode)
+    {
+    case OP_RET:
+    case OP_SE_BYTE:
+    case OP_SNE_BYTE:
+    case OP_SE_REG:
+    case OP_SNE_REG:
+    case OP_JP_V0:
+    case OP_SKP:
+    case OP_SKNP:
+    case OP_LD_VX_K:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Runs one decoded instruction on the count lanes in members
+static void executeGroup(LockstepContext *lanes, const DecodedInstruction *op, const uint8_t *members,
+                         const int count)
+{
+    const uint8_t x = op->x;
+    const uint8_t kk = op->kk;
+    const uint16_t nnn = op->nnn;
+    uint8_t *vx = lanes->V[x];
+    const uint8_t *vy = lanes->V[op->y];
+    uint8_t *vf = lanes->V[0xF];
+
+    FOR_EACH_MEMBER(lane, lanes->PC[lane] += 2;)
+
+    switch (op->opcode)
+    {
+    case OP_CLS:
+        FOR_EACH_MEMBER(lane, {
+            for (int row = 0; row < DISPLAY_HEIGHT; row++)
+                lanes->frameBuffer[row][lane] = 0;
+        })
+        break;
+    case OP_RET:
+        FOR_EACH_MEMBER(lane, {
+            lanes->SP[lane]--;
+            lanes->PC[lane] = lanes->stack[lanes->SP[lane] & 0xF][lane];
+        })
+        break;
+    case OP_JP:
+        FOR_EACH_MEMBER(lane, lanes->PC[lane] = nnn;)
+        break;
+    case OP_CALL:
+        FOR_EACH_MEMBER(lane, {
+            lanes->stack[lanes->SP[lane] & 0xF][lane] = lanes->PC[lane];
+            lanes->SP[lane]++;
+            lanes->PC[lane] = nnn;
+        })
+        break;
+    case OP_SE_BYTE:
+        FOR_EACH_MEMBER(lane, lanes->PC[lane] += (vx[lane] == kk) * 2;)
+        break;
+    case OP_SNE_BYTE:
+        FOR_EACH_MEMBER(lane, lanes->PC[lane] += (vx[lane] != kk) * 2;)
+        break;
+    case OP_SE_REG:
+        FOR_EACH_MEMBER(lane, lanes->PC[lane] += (vx[lane] == vy[lane]) * 2;)
+        break;
+    case OP_SNE_REG:
+        FOR_EACH_MEMBER(lane, lanes->PC[lane] += (vx[lane] != vy[lane]) * 2;)
+        break;
+    case OP_LD_BYTE:
+        FOR_EACH_MEMBER(lane, vx[lane] = kk;)
+        break;
+    case OP_ADD_BYTE:
+        FOR_EACH_MEMBER(lane, vx[lane] += kk;)
+        break;
+    case OP_LD_REG:
+        FOR_EACH_MEMBER(lane, vx[lane] = vy[lane];)
+        break;
+    case OP_OR:
+        FOR_EACH_MEMBER(lane, vx[lane] |= vy[lane];)
+        break;
+    case OP_AND:
+        FOR_EACH_MEMBER(lane, vx[lane] &= vy[lane];)
+        break;
+    case OP_XOR:
+        FOR_EACH_MEMBER(lane, vx[lane] ^= vy[lane];)
+        break;
+    // The flag writes follow the same order as the interpreter, so x or y
+    // being F gives the same result
+    case OP_ADD_REG:
+        FOR_EACH_MEMBER(lane, {
+            const uint16_t result = vx[lane] + vy[lane];
+            vx[lane] = (uint8_t)result;
+            vf[lane] = result > 0xFF;
+        })
+        break;
+    case OP_SUB:
+        FOR_EACH_MEMBER(lane, {
+            vf[lane] = vx[lane] > vy[lane];
+            vx[lane] = vx[lane] - vy[lane];
+        })
+        break;
+    case OP_SHR:
+        FOR_EACH_MEMBER(lane, {
+            vf[lane] = vx[lane] & 1;
+            vx[lane] = vx[lane] >> 1;
+        })
+        break;
+    case OP_SUBN:
+        FOR_EACH_MEMBER(lane, {
+            vf[lane] = vy[lane] > vx[lane];
+            vx[lane] = vy[lane] - vx[lane];
+        })
+        break;
+    case OP_SHL:
+        FOR_EACH_MEMBER(lane, {
+            vf[lane] = vx[lane] >> 7;
+            vx[lane] = vx[lane] << 1;
+        })
+        break;
+    case OP_LD_I:
+        FOR_EACH_MEMBER(lane, lanes->I[lane] = nnn;)
+        break;
+    case OP_JP_V0:
+        FOR_EACH_MEMBER(lane, lanes->PC[lane] = nnn + lanes->V[0][lane];)
+        break;
+    case OP_RND:
+        FOR_EACH_MEMBER(lane, vx[lane] = nextRandom(&lanes->rngState[lane]) & kk;)
+        break;
+    case OP_DRW:
+        // Same rotate and XOR as the interpreter, one lane at a time
+        FOR_EACH_MEMBER(lane, {
+            const uint8_t yStart = vy[lane];
+            const uint8_t xStart = vx[lane] % DISPLAY_WIDTH;
+            uint64_t collision = 0;
+            for (int row = 0; row < op->n; row++)
+            {
+                const uint64_t pixels = (uint64_t)lanes->memory[lane][(lanes->I[lane] + row) & 0xFFF] << (DISPLAY_WIDTH - 8);
+                const uint64_t sprite = (pixels >> xStart) | (pixels << ((DISPLAY_WIDTH - xStart) % DISPLAY_WIDTH));
+                uint64_t *line = &lanes->frameBuffer[(yStart + row) % DISPLAY_HEIGHT][lane];
+
+                collision |= *line & sprite;
+                *line ^= sprite;
+            }
+            vf[lane] = collision != 0;
+        })
+        break;
+    case OP_SKP:
+        FOR_EACH_MEMBER(lane, lanes->PC[lane] += ((lanes->keypad[lane] >> (vx[lane] & 0xF)) & 1) * 2;)
+        break;
+    case OP_SKNP:
+        FOR_EACH_MEMBER(lane, lanes->PC[lane] += !((lanes->keypad[lane] >> (vx[lane] & 0xF)) & 1) * 2;)
+        break;
+    case OP_LD_VX_DT:
+        FOR_EACH_MEMBER(lane, vx[lane] = lanes->delayTimer[lane];)
+        break;
+    case OP_LD_VX_K:
+        FOR_EACH_MEMBER(lane, {
+            if (lanes->keypad[lane])
+                vx[lane] = lowestKey(lanes->keypad[lane]);
+            else
+                lanes->PC[lane] -= 2; // Wait, same as the interpreter
+        })
+        break;
+    case OP_LD_DT_VX:
+        FOR_EACH_MEMBER(lane, lanes->delayTimer[lane] = vx[lane];)
+        break;
+    case OP_LD_ST_VX:
+        FOR_EACH_MEMBER(lane, lanes->soundTimer[lane] = vx[lane];)
+        break;
+    case OP_ADD_I_VX:
+        FOR_EACH_MEMBER(lane, lanes->I[lane] += vx[lane];)
+        break;
+    case OP_LD_F_VX:
+        FOR_EACH_MEMBER(lane, lanes->I[lane] = vx[lane] * 5;)
+        break;
+    case OP_LD_B_VX:
+        FOR_EACH_MEMBER(lane, {
+            const uint16_t address = lanes->I[lane];
+            lanes->memory[lane][address & 0xFFF] = vx[lane] / 100;
+            lanes->memory[lane][(address + 1) & 0xFFF] = (vx[lane] / 10) % 10;
+            lanes->memory[lane][(address + 2) & 0xFFF] = vx[lane] % 10;
+            for (int i = 0; i < 3; i++)
+                lanes->mayDiffer[(address + i) & 0xFFF] = 1;
+        })
+        break;
+    case OP_LD_MEM_VX:
+        FOR_EACH_MEMBER(lane, {
+            for (int i = 0; i <= x; i++)
+            {
+                lanes->memory[lane][(lanes->I[lane] + i) & 0xFFF] = lanes->V[i][lane];
+                lanes->mayDiffer[(lanes->I[lane] + i) & 0xFFF] = 1;
+            }
+        })
+        break;
+    case OP_LD_VX_MEM:
+        FOR_EACH_MEMBER(lane, {
+            for (int i = 0; i <= x; i++)
+                lanes->V[i][lane] = lanes->memory[lane][(lanes->I[lane] + i) & 0xFFF];
+        })
+        break;
+    default:
+        // Unknown instructions are skipped, as in executeCPUCycles
+        break;
+    }
+}
+
+// Lanes a and b are at the same PC on the same instruction
+static int sameInstruction(const LockstepContext *lanes, const int a, const int b)
+{
+    const uint16_t address = lanes->PC[a] & 0xFFF;
+    return (lanes->PC[b] & 0xFFF) == address &&
+           fetchInstruction(lanes, a, address) == fetchInstruction(lanes, b, address);
+}
+
+// Puts every lane in the first group whose lead it matches, and marks the
+// addresses where the lanes were loaded with different bytes
+static void groupLanes(LockstepContext *lanes)
+{
+    for (int address = 0; address < MEMORY_SIZE; address++)
+    {
+        lanes->mayDiffer[address] = 0;
+        for (int lane = 1; lane < LOCKSTEP_LANES; lane++)
+            lanes->mayDiffer[address] |= lanes->memory[lane][address] != lanes->memory[0][address];
+    }
+
+    lanes->groupCount = 0;
+    FOR_EACH_LANE(lane)
+    {
+        int group = 0;
+        while (group < lanes->groupCount && !sameInstruction(lanes, lanes->groups[group][0], lane))
+            group++;
+        if (group == lanes->groupCount)
+            lanes->groupSize[lanes->groupCount++] = 0;
+        lanes->groups[group][lanes->groupSize[group]++] = lane;
+    }
+}
+
+// Moves the lanes of group that don't match its lead, by PC alone or by PC
+// and instruction, into a new group at the end. Returns nonzero if any moved.
+static int splitGroup(LockstepContext *lanes, const int group, const int byInstruction)
+{
+    uint8_t *members = lanes->groups[group];
+    const int lead = members[0];
+    const uint16_t address = lanes->PC[lead] & 0xFFF;
+    const int split = lanes->groupCount;
+    int kept = 1;
+
+    lanes->groupSize[split] = 0;
+    for (int member = 1; member < lanes->groupSize[group]; member++)
+    {
+        const int lane = members[member];
+        if (byInstruction ? sameInstruction(lanes, lead, lane) : (lanes->PC[lane] & 0xFFF) == address)
+            members[kept++] = lane;
+        else
+            lanes->groups[split][lanes->groupSize[split]++] = lane;
+    }
+
+    if (kept == lanes->groupSize[group])
+        return 0;
+    lanes->groupSize[group] = kept;
+    lanes->groupCount++;
+    return 1;
+}
+
+// Merges group into the first other group on the same instruction, if any,
+// and fills its slot with the last group. Groups flagged in ranAhead are
+// further along and can't be merged with.
+static void mergeGroup(LockstepContext *lanes, const int group, uint32_t *ranAhead)
+{
+    const int lead = lanes->groups[group][0];
+    const uint16_t address = lanes->PC[lead] & 0xFFF;
+    for (int other = 0; other < lanes->groupCount; other++)
+    {
+        // Most groups are elsewhere, so the PC alone rules them out
+        const int otherLead = lanes->groups[other][0];
+        if (other == group || (*ranAhead & (1u << other)) || (lanes->PC[otherLead] & 0xFFF) != address ||
+            !sameInstruction(lanes, otherLead, lead))
+            continue;
+
+        memcpy(&lanes->groups[other][lanes->groupSize[other]], lanes->groups[group], lanes->groupSize[group]);
+        lanes->groupSize[other] += lanes->groupSize[group];
+
+        const int last = --lanes->groupCount;
+        memcpy(lanes->groups[group], lanes->groups[last], lanes->groupSize[last]);
+        lanes->groupSize[group] = lanes->groupSize[last];
+        *ranAhead = (*ranAhead & ~(1u << group) & ~(1u << last)) | (((*ranAhead >> last) & 1) << group);
+        return;
+    }
+}
+
+// Runs every lane of a small group by itself through all cycles, which
+// saves the per-step bookkeeping that only pays off for groups big enough
+// to vectorize. A key wait ends a lane early, as in runFrame: it would only
+// execute Fx0A again.
+static void runAlone(LockstepContext *lanes, const uint8_t *members, const int count, const int cycles)
+{
+    for (int member = 0; member < count; member++)
+    {
+        const int lane = members[member];
+        for (int cycle = 0; cycle < cycles; cycle++)
+        {
+            const uint16_t address = lanes->PC[lane] & 0xFFF;
+            const DecodedInstruction *op = decodeCached(lanes, address, fetchInstruction(lanes, lane, address));
+            executeGroup(lanes, op, &members[member], 1);
+            if (op->opcode == OP_LD_VX_K && lanes->keypad[lane] == 0)
+                break;
+        }
+    }
+}
+
+// Runs one instruction on every lane that has cycles left, then regroups
+// lanes that branched apart or met again. A group too small to vectorize
+// runs all cycles instead and is flagged in ranAhead.
+static void runStep(LockstepContext *lanes, const int cycles, uint32_t *ranAhead)
+{
+    uint32_t moved = 0; // Groups that didn't just step to the next instruction
+
+    // Lanes that wrote different bytes into their own memory may disagree
+    // on the instruction. They split off into a group of their own, which
+    // runs further down this same loop.
+    uint32_t pending = ~*ranAhead & ((1u << lanes->groupCount) - 1);
+    while (pending)
+    {
+        const int group = lowestGroup(pending);
+        pending &= pending - 1;
+
+        const uint8_t *members = lanes->groups[group];
+        const int lead = members[0];
+        const uint16_t address = lanes->PC[lead] & 0xFFF;
+        if (lanes->groupSize[group] > 1 && (lanes->mayDiffer[address] | lanes->mayDiffer[(address + 1) & 0xFFF]) &&
+            splitGroup(lanes, group, 1))
+            pending |= 1u << (lanes->groupCount - 1);
+
+        const int count = lanes->groupSize[group];
+        if (count < MIN_GROUP_LANES)
+        {
+            runAlone(lanes, members, count, cycles);
+            *ranAhead |= 1u << group;
+            continue;
+        }
+
+        const DecodedInstruction *op = decodeCached(lanes, address, fetchInstruction(lanes, lead, address));
+        executeGroup(lanes, op, members, count);
+
+        if ((lanes->PC[lead] & 0xFFF) != ((address + 2) & 0xFFF) || mayDiverge(op->opcode))
+            moved |= 1u << group;
+    }
+
+    // Split groups whose lanes went different ways, including the groups
+    // split off here
+    pending = moved;
+    while (pending)
+    {
+        const int group = lowestGroup(pending);
+        pending &= pending - 1;
+        if (lanes->groupSize[group] > 1 && splitGroup(lanes, group, 0))
+        {
+            moved |= 1u << (lanes->groupCount - 1);
+            pending |= 1u << (lanes->groupCount - 1);
+        }
+    }
+
+    // Only a group that jumped can land on another group's PC: two groups
+    // stepping to their next instructions stay the same distance apart.
+    // Going down keeps the groups still to check in place when mergeGroup
+    // moves the last group into a merged slot.
+    while (moved)
+    {
+        const int group = highestGroup(moved);
+        moved &= ~(1u << group);
+        mergeGroup(lanes, group, ranAhead);
+    }
+}
+
+void runLockstep(LockstepContext *lanes, const int cycles)
+{
+    if (lanes->groupCount == 0)
+        groupLanes(lanes);
+
+    uint32_t ranAhead = 0;
+    for (int step = 0; step < cycles && ranAhead != (1u << lanes->groupCount) - 1; step++)
+        runStep(lanes, cycles - step, &ranAhead);
+
+    // Every lane has run all cycles now. Lanes that ran alone may have left
+    // their group, and may have caught up with another one.
+    uint32_t pending = ranAhead;
+    while (pending)
+    {
+        const int group = lowestGroup(pending);
+        pending &= pending - 1;
+        if (lanes->groupSize[group] > 1 && splitGroup(lanes, group, 0))
+        {
+            ranAhead |= 1u << (lanes->groupCount - 1);
+            pending |= 1u << (lanes->groupCount - 1);
+        }
+    }
+
+    uint32_t none = 0;
+    while (ranAhead)
+    {
+        const int group = highestGroup(ranAhead);
+        ranAhead &= ~(1u << group);
+        mergeGroup(lanes, group, &none);
+    }
+}
+
+void runLockstepFrame(LockstepContext *lanes, const int instructionsPerFrame)
+{
+    runLockstep(lanes, instructionsPerFrame);
+
+    FOR_EACH_LANE(lane)
+    {
+        lanes->delayTimer[lane] -= lanes->delayTimer[lane] > 0;
+        lanes->soundTimer[lane] -= lanes->soundTimer[lane] > 0;
+    }
+}
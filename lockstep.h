@@ -0,0 +1,46 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include "chip8.h"
+
+#define LOCKSTEP_LANES 16
+
+// Many instances of the same ROM stored as structure of arrays: every
+// register is an array with one entry per lane. Lanes that are at the same
+// PC on the same instruction run it together as one loop over the lanes,
+// which the compiler turns into vector instructions while every lane is in
+// it; lanes that diverged run their own instructions one lane at a time.
+typedef struct LockstepContext
+{
+  uint8_t V[16][LOCKSTEP_LANES];
+  uint16_t I[LOCKSTEP_LANES];
+  uint16_t PC[LOCKSTEP_LANES];
+  uint8_t SP[LOCKSTEP_LANES];
+  uint8_t delayTimer[LOCKSTEP_LANES];
+  uint8_t soundTimer[LOCKSTEP_LANES];
+  uint16_t keypad[LOCKSTEP_LANES]; // Set by the host, as in ChipContext
+  uint32_t rngState[LOCKSTEP_LANES];
+  uint16_t stack[16][LOCKSTEP_LANES];
+  uint64_t frameBuffer[DISPLAY_HEIGHT][LOCKSTEP_LANES];
+
+  uint8_t memory[LOCKSTEP_LANES][MEMORY_SIZE]; // Lanes may write their own memory
+
+  // Lanes grouped by PC, kept from one step to the next. loadLane empties
+  // it so the next run regroups.
+  uint8_t groups[LOCKSTEP_LANES][LOCKSTEP_LANES]; // Lane numbers, lead first
+  uint8_t groupSize[LOCKSTEP_LANES];
+  uint8_t groupCount;
+
+  // Decoded instructions shared by the lanes, with the instruction each
+  // entry was decoded from since lanes may hold different ones
+  DecodedInstruction decoded[MEMORY_SIZE];
+  uint16_t decodedWord[MEMORY_SIZE];
+  uint8_t mayDiffer[MEMORY_SIZE]; // Nonzero where lanes may hold different bytes
+} LockstepContext;
+
+void loadLane(LockstepContext *lanes, const int lane, const ChipContext *chip);
+void storeLane(const LockstepContext *lanes, const int lane, ChipContext *chip);
+void runLockstep(LockstepContext *lanes, int cycles);
+void runLockstepFrame(LockstepContext *lanes, const int instructionsPerFrame);
+
+#endif // LOCKSTEP_H
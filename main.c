@@ -1,24 +1,74 @@
-
 #include "chip8.h"
+#include "display.h"
+#include "rewind.h"
+#include "movie.h"
+#include "trace.h"
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
+#include <time.h>
 #include <SDL2/SDL.h>
 
 #define CPU_FREQUENCY 480
-#define TIMER_FREQUENCY 60
+#define MAX_FRAME_LAG 4 // Frames the loop may fall behind before it stops catching up
+#define TURBO_FRAME_BATCH 64 // Guest frames run between clock reads in turbo mode
+#define REWIND_SECONDS 10
+#define REWIND_CAPACITY (1 << 20) // Bytes, far more than 10 s of deltas need
+#define MAX_RUN_AHEAD 8 // Frames
 
 int main(int argc, char *argv[])
 {
     ChipContext chip;
     Display display;
-    const uint32_t delay = 1000 / CPU_FREQUENCY;
-    const uint32_t timerInterval = 1000 / TIMER_FREQUENCY;
-    uint32_t counter;
-    srand(time(NULL));
+    int instructionsPerFrame = CPU_FREQUENCY / TIMER_FREQUENCY;
 
-    if (argc < 2)
+    const char *romPath = NULL;
+    const char *recordPath = NULL;
+    const char *playPath = NULL;
+    const char *tracePath = NULL;
+    bool turbo = false;
+    int runAhead = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--turbo") == 0)
+            turbo = true;
+        else if (strcmp(argv[i], "--runahead") == 0 && i + 1 < argc)
+        {
+            runAhead = atoi(argv[++i]);
+            if (runAhead < 0 || runAhead > MAX_RUN_AHEAD)
+            {
+                printf("Run-ahead must be between 0 and %d frames\n", MAX_RUN_AHEAD);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+            recordPath = argv[++i];
+        else if (strcmp(argv[i], "--play") == 0 && i + 1 < argc)
+            playPath = argv[++i];
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+            tracePath = argv[++i];
+        else if (!romPath)
+            romPath = argv[i];
+        else
+        {
+            instructionsPerFrame = atoi(argv[i]);
+            if (instructionsPerFrame <= 0)
+            {
+                printf("Instructions per frame must be positive\n");
+                return 1;
+            }
+        }
+    }
+    if (!romPath || (recordPath && playPath))
+    {
+        printf("Usage: %s [--turbo] [--runahead frames] [--record movie | --play movie] [--trace file]\n"
+               "          <path_to_rom> [instructions_per_frame]\n",
+               argv[0]);
+        return 1;
+    }
+    if (recordPath && instructionsPerFrame > MOVIE_MAX_INSTRUCTIONS_PER_FRAME)
     {
-        printf("Usage: %s <path_to_rom>\n", argv[0]);
+        printf("Movies hold at most %d instructions per frame\n", MOVIE_MAX_INSTRUCTIONS_PER_FRAME);
         return 1;
     }
 
@@ -27,12 +77,61 @@ int main(int argc, char *argv[])
     if (initializeGraphics(&display, DISPLAY_WIDTH * SCALE, DISPLAY_HEIGHT * SCALE) == 1)
         return 1; // Window failed to initalize
 
-    if (loadROM(argv[1], &chip) != 0)
+    if (loadROM(romPath, &chip) != 0)
     {
         return 1; // ROM loading failed
     }
 
+    // A movie holds the seed, the speed and the keypad of every frame, which
+    // is all it takes to replay a session exactly
+    Movie movie;
+    uint32_t seed = (uint32_t)time(NULL);
+    bool playing = false;
+    bool recording = false;
+    if (playPath)
+    {
+        if (loadMovie(&movie, playPath) != 0)
+            return 1;
+        if (movie.romHash != hashROM(&chip))
+        {
+            printf("Movie was recorded on a different ROM\n");
+            return 1;
+        }
+        seed = movie.seed;
+        instructionsPerFrame = movie.instructionsPerFrame;
+        playing = true;
+    }
+    else if (recordPath)
+    {
+        initializeMovie(&movie, &chip, seed, instructionsPerFrame);
+        recording = true;
+    }
+    seedRandom(&chip, seed);
+
+    // The last instructions run, written to tracePath on exit
+    if (tracePath)
+    {
+        chip.trace = createTrace();
+        if (!chip.trace)
+            return 1;
+    }
+
+    // Holding Backspace steps back one recorded frame per host frame. Not
+    // available with movies, which can't go back in time.
+    RewindBuffer *history = NULL;
+    if (!recordPath && !playPath)
+        history = createRewind(REWIND_SECONDS * TIMER_FREQUENCY, REWIND_CAPACITY);
+
+    // Frames are scheduled against an absolute deadline so sleep granularity
+    // doesn't accumulate into drift
+    const uint64_t counterFrequency = SDL_GetPerformanceFrequency();
+    const uint64_t frameTicks = counterFrequency / TIMER_FREQUENCY;
+    uint64_t nextFrame = SDL_GetPerformanceCounter() + frameTicks;
+
     bool gameIsRunning = true;
+    bool frameChanged = true;
+    uint16_t keypad = 0; // Kept up to date from key events
+    bool rewindHeld = false;
     while (gameIsRunning)
     {
 
@@ -41,27 +140,134 @@ int main(int argc, char *argv[])
         {
             if (event.type == SDL_QUIT)
                 gameIsRunning = false;
+            else if (handleKeypadEvent(&event, &keypad))
+                continue;
+            else if ((event.type == SDL_KEYDOWN || event.type == SDL_KEYUP) && event.key.keysym.sym == SDLK_BACKSPACE)
+                rewindHeld = event.type == SDL_KEYDOWN;
+            else if (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_FOCUS_LOST)
+            {
+                // Key releases go to another window now
+                keypad = 0;
+                rewindHeld = false;
+            }
+        }
+
+        chip.keypad = keypad;
+
+        const bool rewinding = history && rewindHeld;
+        bool keyWait = false;
+        if (rewinding)
+        {
+            if (popRewind(history, &chip) == 0)
+                frameChanged = true;
         }
+        else
+        {
+            // In turbo mode guest frames run back to back until the next host
+            // frame is due. Timers still tick once per guest frame, so the ROM
+            // behaves exactly as it would in real time
+            do
+            {
+                for (int i = 0; i < (turbo ? TURBO_FRAME_BATCH : 1); i++)
+                {
+                    if (playing && playMovieFrame(&movie, &chip.keypad) != 0)
+                    {
+                        printf("Movie ended, keyboard input resumes\n");
+                        playing = false;
+                    }
+                    if (recording && recordMovieFrame(&movie, chip.keypad) != 0)
+                    {
+                        printf("Out of memory, recording stopped\n");
+                        recording = false;
+                    }
+                    if (runFrame(&chip, instructionsPerFrame, NULL))
+                        frameChanged = true;
+                }
+            } while (turbo && !isWaitingForKey(&chip) && SDL_GetPerformanceCounter() < nextFrame);
 
-        executeCPUCycle(&chip, &display);
+            // A movie presses its keys by itself, so only keyboard input waits
+            keyWait = !playing && isWaitingForKey(&chip);
+
+            // One rewind step per host frame, so turbo rewinds in wall time
+            if (history)
+                pushRewind(history, &chip);
+        }
 
-        // Handle timers
-        if (counter >= timerInterval)
+        // Run-ahead needs a save state of the real frame to come back to.
+        // Restoring it right away changes nothing and proves it restores.
+        // Without one, e.g. after the guest stack overflowed, this frame is
+        // shown as it is.
+        static uint8_t state[MAX_SAVE_STATE_SIZE];
+        size_t length = 0;
+        if (runAhead > 0 && !rewinding)
         {
-            counter = 0;
-            if (chip.delayTimer > 0)
-                chip.delayTimer--;
-            if (chip.soundTimer > 0)
-                chip.soundTimer--;
+            length = saveState(&chip, state, sizeof(state));
+            if (length > 0 && restoreState(&chip, state, length) != 0)
+                length = 0;
         }
 
-        SDL_RenderPresent(display.renderer);
-        SDL_Delay(delay);
-        counter += delay;
+        if (length > 0)
+        {
+            // Show the frame the ROM will draw runAhead frames from now if the
+            // input stays the same, which hides that many frames of the ROM's
+            // own input lag. The real state is put back afterwards.
+            // The trace is left out, those frames never really happen
+            TraceBuffer *trace = chip.trace;
+            chip.trace = NULL;
+            for (int i = 0; i < runAhead; i++)
+                runFrame(&chip, instructionsPerFrame, NULL);
+            drawFrameBuffer(&display, &chip);
+            if (restoreState(&chip, state, length) != 0)
+            {
+                printf("Failed to restore the state before run-ahead, run-ahead turned off\n");
+                runAhead = 0;
+            }
+            chip.trace = trace;
+            frameChanged = false;
+        }
+        else if (frameChanged || runAhead > 0)
+        {
+            // With run-ahead on, the screen still shows a frame from ahead
+            drawFrameBuffer(&display, &chip);
+            frameChanged = false;
+        }
+        presentDisplay(&display);
+
+        // Sleep until the next frame is due. Turbo mode never sleeps and only
+        // uses the deadline to decide when to present again, except while the
+        // ROM waits for a key
+        const uint64_t now = SDL_GetPerformanceCounter();
+        if (keyWait && chip.delayTimer == 0 && chip.soundTimer == 0)
+        {
+            // Fx0A is blocked and both timers have stopped, so no frame can
+            // change anything before an event comes in. Sleep until one does
+            // and run the next frame right away.
+            SDL_WaitEvent(NULL);
+            nextFrame = SDL_GetPerformanceCounter();
+        }
+        else
+        {
+            if (turbo && !keyWait)
+                nextFrame = now;
+            else if (now < nextFrame)
+                SDL_Delay((uint32_t)((nextFrame - now) * 1000 / counterFrequency));
+            else if (now - nextFrame > MAX_FRAME_LAG * frameTicks)
+                nextFrame = now; // Too far behind (e.g. window dragged), resync
+            nextFrame += frameTicks;
+        }
     }
 
-    SDL_DestroyRenderer(display.renderer);
-    SDL_DestroyWindow(display.window);
-    SDL_Quit();
+#if defined(CHIP8_PROFILE)
+    printProfile(&chip, stdout);
+#endif
+    if (recordPath)
+        saveMovie(&movie, recordPath);
+    if (recordPath || playPath)
+        freeMovie(&movie);
+    if (tracePath)
+        saveTrace(chip.trace, tracePath);
+    destroyTrace(chip.trace);
+    destroyRewind(history);
+    destroyGraphics(&display);
     return 0;
-}
\ No newline at end of file
+}
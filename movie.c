@@ -0,0 +1,205 @@
+#include "movie.h"
+
+// Movie file layout, multi-byte values little endian:
+//   "C8M" version
+//   seed, instructions per frame, ROM hash, frame count, run count
+//   run count x (keypad, frames)
+
+#define MOVIE_HEADER_SIZE (4 + 4 + 2 + 4 + 4 + 4)
+#define MOVIE_RUN_SIZE 4
+
+static void put16(uint8_t *p, const uint16_t value)
+{
+    p[0] = value & 0xFF;
+    p[1] = value >> 8;
+}
+
+static void put32(uint8_t *p, const uint32_t value)
+{
+    put16(p, value & 0xFFFF);
+    put16(p + 2, value >> 16);
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+// FNV-1a over the loaded program, so a movie isn't replayed on another ROM
+uint32_t hashROM(const ChipContext *chip)
+{
+    uint32_t hash = 2166136261u;
+    for (int address = chip->memoryLow; address < chip->memoryHigh; address++)
+    {
+        hash ^= chip->memory[address];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Starts an empty movie for a chip that has just loaded its ROM. Hosts
+// reject instructionsPerFrame above MOVIE_MAX_INSTRUCTIONS_PER_FRAME first.
+void initializeMovie(Movie *movie, const ChipContext *chip, const uint32_t seed, const int instructionsPerFrame)
+{
+    memset(movie, 0, sizeof(Movie));
+    movie->seed = seed;
+    movie->instructionsPerFrame = instructionsPerFrame;
+    movie->romHash = hashROM(chip);
+}
+
+void freeMovie(Movie *movie)
+{
+    free(movie->runs);
+    movie->runs = NULL;
+    movie->runCount = 0;
+    movie->runCapacity = 0;
+}
+
+// Appends one frame of input, returns nonzero if out of memory
+int recordMovieFrame(Movie *movie, const uint16_t keypad)
+{
+    MovieRun *last = movie->runCount > 0 ? &movie->runs[movie->runCount - 1] : NULL;
+    if (last && last->keypad == keypad && last->frames < 0xFFFF)
+    {
+        last->frames++;
+        movie->frameCount++;
+        return 0;
+    }
+
+    if (movie->runCount == movie->runCapacity)
+    {
+        const uint32_t capacity = movie->runCapacity ? movie->runCapacity * 2 : 256;
+        MovieRun *runs = realloc(movie->runs, capacity * sizeof(MovieRun));
+        if (!runs)
+            return 1;
+        movie->runs = runs;
+        movie->runCapacity = capacity;
+    }
+
+    movie->runs[movie->runCount].keypad = keypad;
+    movie->runs[movie->runCount].frames = 1;
+    movie->runCount++;
+    movie->frameCount++;
+    return 0;
+}
+
+// Gives the keypad for the next frame, returns nonzero once the movie ended
+int playMovieFrame(Movie *movie, uint16_t *keypad)
+{
+    if (movie->playRun >= movie->runCount)
+        return 1;
+
+    const MovieRun *run = &movie->runs[movie->playRun];
+    *keypad = run->keypad;
+    if (++movie->playFrame == run->frames)
+    {
+        movie->playRun++;
+        movie->playFrame = 0;
+    }
+    return 0;
+}
+
+int saveMovie(const Movie *movie, const char *filename)
+{
+    FILE *file = fopen(filename, "wb");
+    if (!file)
+    {
+        printf("Failed to create movie file: %s\n", filename);
+        return 1;
+    }
+
+    uint8_t header[MOVIE_HEADER_SIZE] = {'C', '8', 'M', MOVIE_VERSION};
+    put32(header + 4, movie->seed);
+    put16(header + 8, movie->instructionsPerFrame);
+    put32(header + 10, movie->romHash);
+    put32(header + 14, movie->frameCount);
+    put32(header + 18, movie->runCount);
+    int failed = fwrite(header, sizeof(header), 1, file) != 1;
+
+    for (uint32_t i = 0; i < movie->runCount && !failed; i++)
+    {
+        uint8_t run[MOVIE_RUN_SIZE];
+        put16(run, movie->runs[i].keypad);
+        put16(run + 2, movie->runs[i].frames);
+        failed = fwrite(run, sizeof(run), 1, file) != 1;
+    }
+
+    if (fclose(file) != 0 || failed)
+    {
+        printf("Failed to write movie file: %s\n", filename);
+        return 1;
+    }
+    return 0;
+}
+
+int loadMovie(Movie *movie, const char *filename)
+{
+    memset(movie, 0, sizeof(Movie));
+
+    FILE *file = fopen(filename, "rb");
+    if (!file)
+    {
+        printf("Failed to open movie file: %s\n", filename);
+        return 1;
+    }
+
+    fseek(file, 0, SEEK_END);
+    const long fileSize = ftell(file);
+    rewind(file);
+
+    uint8_t header[MOVIE_HEADER_SIZE];
+    if (fileSize < 0 || fread(header, sizeof(header), 1, file) != 1 ||
+        header[0] != 'C' || header[1] != '8' || header[2] != 'M' || header[3] != MOVIE_VERSION)
+    {
+        printf("Not a version %d movie file: %s\n", MOVIE_VERSION, filename);
+        fclose(file);
+        return 1;
+    }
+
+    movie->seed = get32(header + 4);
+    movie->instructionsPerFrame = get16(header + 8);
+    movie->romHash = get32(header + 10);
+    const uint32_t frameCount = get32(header + 14);
+    const uint32_t runCount = get32(header + 18);
+
+    // A corrupt run count must not size the allocation
+    if (runCount > (uint64_t)(fileSize - MOVIE_HEADER_SIZE) / MOVIE_RUN_SIZE)
+    {
+        printf("Movie file is truncated or corrupt: %s\n", filename);
+        fclose(file);
+        return 1;
+    }
+
+    movie->runs = malloc((runCount ? runCount : 1) * sizeof(MovieRun));
+    if (!movie->runs)
+    {
+        fclose(file);
+        return 1;
+    }
+    movie->runCapacity = runCount;
+
+    for (uint32_t i = 0; i < runCount; i++)
+    {
+        uint8_t run[MOVIE_RUN_SIZE];
+        if (fread(run, sizeof(run), 1, file) != 1 || get16(run + 2) == 0)
+            break;
+        movie->runs[i].keypad = get16(run);
+        movie->runs[i].frames = get16(run + 2);
+        movie->frameCount += movie->runs[i].frames;
+        movie->runCount++;
+    }
+    fclose(file);
+
+    if (movie->runCount != runCount || movie->frameCount != frameCount || movie->instructionsPerFrame == 0)
+    {
+        printf("Movie file is truncated or corrupt: %s\n", filename);
+        freeMovie(movie);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,43 @@
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#include "chip8.h"
+
+#define MOVIE_VERSION 2
+#define MOVIE_MAX_INSTRUCTIONS_PER_FRAME 0xFFFF // Stored in 16 bits
+
+// A keypad bitmask held for a number of frames
+typedef struct MovieRun
+{
+  uint16_t keypad;
+  uint16_t frames;
+} MovieRun;
+
+// Everything needed to replay a session exactly: the Cxkk seed, the
+// instructions per frame, a hash of the ROM it was recorded on and the
+// keypad of every frame, run-length encoded.
+typedef struct Movie
+{
+  uint32_t seed;
+  uint16_t instructionsPerFrame;
+  uint32_t romHash;
+  uint32_t frameCount;
+
+  MovieRun *runs;
+  uint32_t runCount;
+  uint32_t runCapacity;
+
+  // Playback position
+  uint32_t playRun;
+  uint16_t playFrame;
+} Movie;
+
+uint32_t hashROM(const ChipContext *chip);
+void initializeMovie(Movie *movie, const ChipContext *chip, const uint32_t seed, const int instructionsPerFrame);
+void freeMovie(Movie *movie);
+int recordMovieFrame(Movie *movie, const uint16_t keypad);
+int playMovieFrame(Movie *movie, uint16_t *keypad);
+int saveMovie(const Movie *movie, const char *filename);
+int loadMovie(Movie *movie, const char *filename);
+
+#endif // MOVIE_H
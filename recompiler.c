@@ -0,0 +1,504 @@
+#include "chip8.h"
+#include <ctype.h>
+
+// Ahead-of-time translation of a ROM into C. Code reachable from 0x200 is
+// split into blocks that run inline on ChipContext; everything else (computed
+// jumps, returns into unknown code, self-modified code) goes back to the
+// interpreter.
+
+// Static information about every address
+typedef struct Analysis
+{
+    uint8_t reached[MEMORY_SIZE]; // An instruction starts here
+    uint8_t leader[MEMORY_SIZE];  // A block starts here
+    uint16_t instruction[MEMORY_SIZE];
+    DecodedInstruction op[MEMORY_SIZE];
+} Analysis;
+
+static int isValidTarget(const int address)
+{
+    return address >= ROM_START_ADDRESS && address + 1 < MEMORY_SIZE;
+}
+
+// Instructions that leave a block. Everything else falls through to pc + 2.
+static int endsBlock(const uint8_t opcode)
+{
+    switch (opcode)
+    {
+    case OP_RET:
+    case OP_JP:
+    case OP_CALL:
+    case OP_SE_BYTE:
+    case OP_SNE_BYTE:
+    case OP_SE_REG:
+    case OP_SNE_REG:
+    case OP_JP_V0:
+    case OP_SKP:
+    case OP_SKNP:
+    case OP_LD_VX_K:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Recursive descent over the control flow graph starting at 0x200
+static void discoverCode(const ChipContext *chip, Analysis *analysis)
+{
+    static uint16_t worklist[MEMORY_SIZE * 4];
+    int count = 0;
+
+    worklist[count++] = ROM_START_ADDRESS;
+    analysis->leader[ROM_START_ADDRESS] = 1;
+
+    while (count > 0)
+    {
+        const uint16_t pc = worklist[--count];
+        if (!isValidTarget(pc) || analysis->reached[pc])
+            continue;
+
+        DecodedInstruction *op = &analysis->op[pc];
+        analysis->instruction[pc] = (chip->memory[pc] << 8) | chip->memory[pc + 1];
+        decodeInstruction(analysis->instruction[pc], op);
+        analysis->reached[pc] = 1;
+
+        // Successors, and whether each one starts a block
+        int successors[2];
+        int leaders[2];
+        int successorCount = 0;
+
+        switch (op->opcode)
+        {
+        case OP_RET:
+        case OP_JP_V0:
+            break;
+
+        case OP_JP:
+            successors[successorCount] = op->nnn;
+            leaders[successorCount++] = 1;
+            break;
+
+        case OP_CALL:
+            successors[successorCount] = op->nnn;
+            leaders[successorCount++] = 1;
+            successors[successorCount] = pc + 2; // Return address
+            leaders[successorCount++] = 1;
+            break;
+
+        case OP_SE_BYTE:
+        case OP_SNE_BYTE:
+        case OP_SE_REG:
+        case OP_SNE_REG:
+        case OP_SKP:
+        case OP_SKNP:
+            successors[successorCount] = pc + 2;
+            leaders[successorCount++] = 1;
+            successors[successorCount] = pc + 4;
+            leaders[successorCount++] = 1;
+            break;
+
+        case OP_LD_VX_K: // Re-executes itself until a key is down
+            analysis->leader[pc] = 1;
+            successors[successorCount] = pc + 2;
+            leaders[successorCount++] = 1;
+            break;
+
+        default:
+            successors[successorCount] = pc + 2;
+            leaders[successorCount++] = 0;
+            break;
+        }
+
+        for (int i = 0; i < successorCount; i++)
+        {
+            if (!isValidTarget(successors[i]))
+                continue;
+            if (leaders[i])
+                analysis->leader[successors[i]] = 1;
+            worklist[count++] = successors[i];
+        }
+    }
+}
+
+// Number of instructions in the block starting at leader
+static int blockLength(const Analysis *analysis, const uint16_t leader)
+{
+    int length = 1;
+    uint16_t pc = leader;
+    while (!endsBlock(analysis->op[pc].opcode) && isValidTarget(pc + 2) && analysis->reached[pc + 2] &&
+           !analysis->leader[pc + 2])
+    {
+        pc += 2;
+        length++;
+    }
+    return length;
+}
+
+static void emitJump(FILE *out, const Analysis *analysis, const int target, const char *indent)
+{
+    if (isValidTarget(target) && analysis->leader[target] && analysis->reached[target])
+        fprintf(out, "%s    goto L_%03X;\n", indent, target);
+    else
+    {
+        fprintf(out, "%s    chip->PC = 0x%03X;\n", indent, target & 0xFFFF);
+        fprintf(out, "%s    goto dispatch;\n", indent);
+    }
+}
+
+static void emitSkip(FILE *out, const Analysis *analysis, const char *condition, const uint16_t pc)
+{
+    fprintf(out, "    if (%s)\n", condition);
+    fprintf(out, "    {\n");
+    emitJump(out, analysis, pc + 4, "    ");
+    fprintf(out, "    }\n");
+    emitJump(out, analysis, pc + 2, "");
+}
+
+// Runs one instruction on the interpreter from inside a block
+static void emitInterpreted(FILE *out, const uint16_t pc)
+{
+    fprintf(out, "    chip->PC = 0x%03X;\n", pc);
+    fprintf(out, "    executeCPUCycle(chip);\n");
+}
+
+static void emitInstruction(FILE *out, const Analysis *analysis, const uint16_t pc, const int remaining)
+{
+    const DecodedInstruction *op = &analysis->op[pc];
+    const int x = op->x;
+    const int y = op->y;
+    char condition[64];
+
+    switch (op->opcode)
+    {
+    case OP_RET:
+        fprintf(out, "    chip->SP--;\n");
+        fprintf(out, "    chip->PC = chip->stack[chip->SP];\n");
+        fprintf(out, "    goto dispatch;\n");
+        break;
+
+    case OP_JP:
+        emitJump(out, analysis, op->nnn, "");
+        break;
+
+    case OP_CALL:
+        fprintf(out, "    chip->stack[chip->SP] = 0x%03X;\n", pc + 2);
+        fprintf(out, "    chip->SP++;\n");
+        emitJump(out, analysis, op->nnn, "");
+        break;
+
+    case OP_SE_BYTE:
+        sprintf(condition, "chip->V[0x%X] == 0x%02X", x, op->kk);
+        emitSkip(out, analysis, condition, pc);
+        break;
+
+    case OP_SNE_BYTE:
+        sprintf(condition, "chip->V[0x%X] != 0x%02X", x, op->kk);
+        emitSkip(out, analysis, condition, pc);
+        break;
+
+    case OP_SE_REG:
+        sprintf(condition, "chip->V[0x%X] == chip->V[0x%X]", x, y);
+        emitSkip(out, analysis, condition, pc);
+        break;
+
+    case OP_SNE_REG:
+        sprintf(condition, "chip->V[0x%X] != chip->V[0x%X]", x, y);
+        emitSkip(out, analysis, condition, pc);
+        break;
+
+    case OP_LD_BYTE:
+        fprintf(out, "    chip->V[0x%X] = 0x%02X;\n", x, op->kk);
+        break;
+
+    case OP_ADD_BYTE:
+        fprintf(out, "    chip->V[0x%X] += 0x%02X;\n", x, op->kk);
+        break;
+
+    case OP_LD_REG:
+        fprintf(out, "    chip->V[0x%X] = chip->V[0x%X];\n", x, y);
+        break;
+
+    case OP_OR:
+        fprintf(out, "    chip->V[0x%X] |= chip->V[0x%X];\n", x, y);
+        break;
+
+    case OP_AND:
+        fprintf(out, "    chip->V[0x%X] &= chip->V[0x%X];\n", x, y);
+        break;
+
+    case OP_XOR:
+        fprintf(out, "    chip->V[0x%X] ^= chip->V[0x%X];\n", x, y);
+        break;
+
+    case OP_ADD_REG:
+        fprintf(out, "    result = chip->V[0x%X] + chip->V[0x%X];\n", x, y);
+        fprintf(out, "    chip->V[0x%X] = (uint8_t)result;\n", x);
+        fprintf(out, "    chip->V[0xF] = result > 0xFF;\n");
+        break;
+
+    case OP_SUB:
+        fprintf(out, "    chip->V[0xF] = chip->V[0x%X] > chip->V[0x%X];\n", x, y);
+        fprintf(out, "    chip->V[0x%X] -= chip->V[0x%X];\n", x, y);
+        break;
+
+    case OP_SHR:
+        fprintf(out, "    chip->V[0xF] = chip->V[0x%X] & 1;\n", x);
+        fprintf(out, "    chip->V[0x%X] >>= 1;\n", x);
+        break;
+
+    case OP_SUBN:
+        fprintf(out, "    chip->V[0xF] = chip->V[0x%X] > chip->V[0x%X];\n", y, x);
+        fprintf(out, "    chip->V[0x%X] = chip->V[0x%X] - chip->V[0x%X];\n", x, y, x);
+        break;
+
+    case OP_SHL:
+        fprintf(out, "    chip->V[0xF] = chip->V[0x%X] >> 7;\n", x);
+        fprintf(out, "    chip->V[0x%X] <<= 1;\n", x);
+        break;
+
+    case OP_LD_I:
+        fprintf(out, "    chip->I = 0x%03X;\n", op->nnn);
+        break;
+
+    case OP_JP_V0:
+        fprintf(out, "    chip->PC = 0x%03X + chip->V[0];\n", op->nnn);
+        fprintf(out, "    goto dispatch;\n");
+        break;
+
+    case OP_LD_VX_DT:
+        fprintf(out, "    chip->V[0x%X] = chip->delayTimer;\n", x);
+        break;
+
+    case OP_LD_DT_VX:
+        fprintf(out, "    chip->delayTimer = chip->V[0x%X];\n", x);
+        break;
+
+    case OP_LD_ST_VX:
+        fprintf(out, "    chip->soundTimer = chip->V[0x%X];\n", x);
+        break;
+
+    case OP_ADD_I_VX:
+        fprintf(out, "    chip->I += chip->V[0x%X];\n", x);
+        break;
+
+    case OP_LD_F_VX:
+        fprintf(out, "    chip->I = chip->V[0x%X] * 5;\n", x);
+        break;
+
+    case OP_SKP:
+    case OP_SKNP:
+    case OP_LD_VX_K:
+        // Input stays on the interpreter, which leaves PC at the next
+        // instruction to run
+        emitInterpreted(out, pc);
+        fprintf(out, "    goto dispatch;\n");
+        break;
+
+    case OP_LD_B_VX:
+    case OP_LD_MEM_VX:
+        // Stores into translated code hand the rest of the run to the interpreter
+        fprintf(out, "    writeAddress = chip->I;\n");
+        emitInterpreted(out, pc);
+        fprintf(out, "    if (writesCode(chip, writeAddress, %d))\n", op->opcode == OP_LD_B_VX ? 3 : x + 1);
+        fprintf(out, "    {\n");
+        fprintf(out, "        executeCPUCycles(chip, cycles + %d);\n", remaining);
+        fprintf(out, "        return;\n");
+        fprintf(out, "    }\n");
+        break;
+
+    default: // 00E0, Cxkk, Dxyn, Fx65 and unknown instructions
+        emitInterpreted(out, pc);
+        break;
+    }
+}
+
+static void emitBlock(FILE *out, const Analysis *analysis, const uint16_t leader)
+{
+    const int length = blockLength(analysis, leader);
+
+    fprintf(out, "L_%03X:\n", leader);
+    fprintf(out, "    if (cycles < %d)\n", length);
+    fprintf(out, "    {\n");
+    fprintf(out, "        chip->PC = 0x%03X;\n", leader);
+    fprintf(out, "        goto interpret;\n");
+    fprintf(out, "    }\n");
+    fprintf(out, "    cycles -= %d;\n", length);
+
+    uint16_t pc = leader;
+    for (int i = 0; i < length; i++, pc += 2)
+    {
+        fprintf(out, "    // %03X: %04X\n", pc, analysis->instruction[pc]);
+        emitInstruction(out, analysis, pc, length - i - 1);
+    }
+
+    // Ran into the next block
+    if (!endsBlock(analysis->op[pc - 2].opcode))
+        emitJump(out, analysis, pc, "");
+    fprintf(out, "\n");
+}
+
+static void emitTranslationUnit(FILE *out, const ChipContext *chip, const Analysis *analysis,
+                                const char *romName, const char *functionName)
+{
+    int first = -1;
+    int last = -1;
+    for (int pc = 0; pc < MEMORY_SIZE; pc++)
+    {
+        if (!analysis->reached[pc])
+            continue;
+        if (first < 0)
+            first = pc;
+        last = pc + 1;
+    }
+
+    fprintf(out, "// Generated by recompiler from %s. Do not edit.\n", romName);
+    fprintf(out, "//\n");
+    fprintf(out, "// void %s(ChipContext *chip, int cycles);\n", functionName);
+    fprintf(out, "//\n");
+    fprintf(out, "// Drop-in replacement for executeCPUCycles on a chip with this ROM loaded.\n\n");
+    fprintf(out, "#include \"chip8.h\"\n\n");
+
+    // Original bytes of every translated instruction, to detect self-modifying code
+    fprintf(out, "#define CODE_START 0x%03X\n", first);
+    fprintf(out, "#define CODE_END 0x%03X\n\n", last + 1);
+    fprintf(out, "static const uint8_t code[CODE_END - CODE_START] = {");
+    for (int pc = first; pc <= last; pc++)
+    {
+        if ((pc - first) % 16 == 0)
+            fprintf(out, "\n    ");
+        fprintf(out, "0x%02X,", chip->memory[pc]);
+    }
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "static const uint8_t translated[CODE_END - CODE_START] = {");
+    for (int pc = first; pc <= last; pc++)
+    {
+        if ((pc - first) % 32 == 0)
+            fprintf(out, "\n    ");
+        fprintf(out, "%d,", analysis->reached[pc] || (pc > 0 && analysis->reached[pc - 1]));
+    }
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "static int writesCode(const ChipContext *chip, const uint16_t address, const int length)\n");
+    fprintf(out, "{\n");
+    fprintf(out, "    for (int n = 0; n < length; n++)\n");
+    fprintf(out, "    {\n");
+    fprintf(out, "        const int i = (address + n) & 0xFFF; // Stores wrap past 0xFFF\n");
+    fprintf(out, "        if (i >= CODE_START && i < CODE_END && translated[i - CODE_START] && chip->memory[i] != code[i - CODE_START])\n");
+    fprintf(out, "            return 1;\n");
+    fprintf(out, "    }\n");
+    fprintf(out, "    return 0;\n");
+    fprintf(out, "}\n\n");
+
+    fprintf(out, "void %s(ChipContext *chip, int cycles)\n", functionName);
+    fprintf(out, "{\n");
+    fprintf(out, "    uint16_t result;\n");
+    fprintf(out, "    uint16_t writeAddress;\n\n");
+    fprintf(out, "    // Code changed since translation, stay on the interpreter\n");
+    fprintf(out, "    if (writesCode(chip, CODE_START, CODE_END - CODE_START))\n");
+    fprintf(out, "    {\n");
+    fprintf(out, "        executeCPUCycles(chip, cycles);\n");
+    fprintf(out, "        return;\n");
+    fprintf(out, "    }\n\n");
+
+    fprintf(out, "dispatch:\n");
+    fprintf(out, "    while (cycles > 0)\n");
+    fprintf(out, "    {\n");
+    fprintf(out, "        switch (chip->PC)\n");
+    fprintf(out, "        {\n");
+    for (int pc = 0; pc < MEMORY_SIZE; pc++)
+    {
+        if (analysis->reached[pc] && analysis->leader[pc])
+            fprintf(out, "        case 0x%03X:\n            goto L_%03X;\n", pc, pc);
+    }
+    fprintf(out, "        }\n\n");
+    fprintf(out, "        // Not translated, e.g. the target of Bnnn\n");
+    fprintf(out, "        const uint8_t high = chip->memory[chip->PC & 0xFFF];\n");
+    fprintf(out, "        const uint8_t low = chip->memory[(chip->PC + 1) & 0xFFF];\n");
+    fprintf(out, "        writeAddress = chip->I;\n");
+    fprintf(out, "        executeCPUCycle(chip);\n");
+    fprintf(out, "        cycles--;\n");
+    fprintf(out, "        const int writeLength = (high & 0xF0) != 0xF0 ? 0 : low == 0x33 ? 3 : low == 0x55 ? (high & 0x0F) + 1 : 0;\n");
+    fprintf(out, "        if (writeLength && writesCode(chip, writeAddress, writeLength))\n");
+    fprintf(out, "        {\n");
+    fprintf(out, "            executeCPUCycles(chip, cycles);\n");
+    fprintf(out, "            return;\n");
+    fprintf(out, "        }\n");
+    fprintf(out, "    }\n");
+    fprintf(out, "    return;\n\n");
+
+    fprintf(out, "interpret:\n");
+    fprintf(out, "    // Not enough cycles left for a whole block\n");
+    fprintf(out, "    executeCPUCycles(chip, cycles);\n");
+    fprintf(out, "    return;\n\n");
+
+    for (int pc = 0; pc < MEMORY_SIZE; pc++)
+    {
+        if (analysis->reached[pc] && analysis->leader[pc])
+            emitBlock(out, analysis, pc);
+    }
+
+    fprintf(out, "}\n");
+}
+
+// run_<rom file name without extension>, with anything that is not valid in
+// an identifier replaced by '_'
+static void defaultFunctionName(const char *path, char *name, const size_t size)
+{
+    const char *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+
+    size_t length = snprintf(name, size, "run_%s", base);
+    char *extension = strrchr(name, '.');
+    if (extension)
+        *extension = '\0';
+    for (size_t i = 0; i < length && name[i]; i++)
+    {
+        if (!isalnum((unsigned char)name[i]))
+            name[i] = '_';
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        printf("Usage: %s <path_to_rom> <output.c> [function_name]\n", argv[0]);
+        return 1;
+    }
+
+    static ChipContext chip;
+    static Analysis analysis;
+
+    initializeChip(&chip);
+    if (loadROM(argv[1], &chip) != 0)
+        return 1;
+
+    char functionName[256];
+    if (argc > 3)
+        snprintf(functionName, sizeof(functionName), "%s", argv[3]);
+    else
+        defaultFunctionName(argv[1], functionName, sizeof(functionName));
+
+    discoverCode(&chip, &analysis);
+
+    FILE *out = fopen(argv[2], "w");
+    if (!out)
+    {
+        printf("Failed to open output file: %s\n", argv[2]);
+        return 1;
+    }
+    emitTranslationUnit(out, &chip, &analysis, argv[1], functionName);
+    fclose(out);
+
+    int instructions = 0;
+    int blocks = 0;
+    for (int pc = 0; pc < MEMORY_SIZE; pc++)
+    {
+        instructions += analysis.reached[pc];
+        blocks += analysis.reached[pc] && analysis.leader[pc];
+    }
+    printf("Translated %d instructions in %d blocks into %s (%s)\n", instructions, blocks, argv[2], functionName);
+
+    return 0;
+}
@@ -0,0 +1,50 @@
+#include "chip8.h"
+#include "movie.h"
+#include <time.h>
+
+// Replays a movie headless as fast as possible and prints a hash of the
+// final framebuffer. Given the hash a previous replay printed, it exits
+// with 1 when the replay no longer ends on the same screen.
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        printf("Usage: %s <rom> <movie> [expected_frame_hash]\n", argv[0]);
+        return 1;
+    }
+
+    ChipContext chip;
+    initializeChip(&chip);
+    if (loadROM(argv[1], &chip) != 0)
+        return 1;
+
+    Movie movie;
+    if (loadMovie(&movie, argv[2]) != 0)
+        return 1;
+    if (movie.romHash != hashROM(&chip))
+    {
+        printf("Movie was recorded on a different ROM\n");
+        return 1;
+    }
+
+    seedRandom(&chip, movie.seed);
+    clock_t start = clock();
+    while (playMovieFrame(&movie, &chip.keypad) == 0)
+        runFrame(&chip, movie.instructionsPerFrame, NULL);
+    double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    const uint64_t frameHash = hashFrameBuffer(&chip);
+    printf("%u frames in %.3f s, frame hash %016llx\n", movie.frameCount, seconds, (unsigned long long)frameHash);
+#if defined(CHIP8_PROFILE)
+    printProfile(&chip, stdout);
+#endif
+    freeMovie(&movie);
+
+    if (argc > 3 && strtoull(argv[3], NULL, 16) != frameHash)
+    {
+        printf("Frame hash differs from %s\n", argv[3]);
+        return 1;
+    }
+    return 0;
+}
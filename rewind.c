@@ -0,0 +1,238 @@
+#include "rewind.h"
+
+// Record layout in the ring, lengths 16-bit little endian:
+//   record length, length of the older state, delta, record length
+// The leading length lets pushRewind drop the oldest record and the
+// trailing one lets popRewind find the start of the newest.
+//
+// The delta is the XOR of the older state with the newer one as pairs of
+// (zero count, literal count) followed by the literal bytes. Runs of fewer
+// than MIN_ZERO_RUN zeros stay inside a literal so a pair never costs more
+// than it saves.
+
+#define RECORD_HEADER 4
+#define RECORD_OVERHEAD 6
+#define MIN_ZERO_RUN 4
+#define MAX_DELTA_SIZE (2 * MAX_SAVE_STATE_SIZE + 8)
+
+struct RewindBuffer
+{
+  uint8_t *ring;
+  size_t capacity;
+  size_t head; // Where the next record goes
+  size_t tail; // Oldest record
+  size_t used;
+  int frames;
+  int maxFrames;
+
+  // The newest state and a spare one to save into, both zero past their
+  // length so states of different lengths XOR cleanly
+  uint8_t state[2][MAX_SAVE_STATE_SIZE];
+  size_t stateLength[2];
+  int newest; // -1 before the first push
+
+  uint8_t record[RECORD_OVERHEAD + MAX_DELTA_SIZE];
+};
+
+RewindBuffer *createRewind(const int maxFrames, const size_t capacity)
+{
+    // The ring has to hold at least one record of any size
+    if (maxFrames <= 0 || capacity < RECORD_OVERHEAD + MAX_DELTA_SIZE)
+        return NULL;
+
+    RewindBuffer *history = calloc(1, sizeof(RewindBuffer));
+    if (!history)
+        return NULL;
+
+    history->ring = malloc(capacity);
+    if (!history->ring)
+    {
+        free(history);
+        return NULL;
+    }
+
+    history->capacity = capacity;
+    history->maxFrames = maxFrames;
+    clearRewind(history);
+    return history;
+}
+
+void destroyRewind(RewindBuffer *history)
+{
+    if (!history)
+        return;
+    free(history->ring);
+    free(history);
+}
+
+void clearRewind(RewindBuffer *history)
+{
+    history->head = 0;
+    history->tail = 0;
+    history->used = 0;
+    history->frames = 0;
+    history->newest = -1;
+    memset(history->state, 0, sizeof(history->state));
+    history->stateLength[0] = 0;
+    history->stateLength[1] = 0;
+}
+
+int rewindFrames(const RewindBuffer *history)
+{
+    return history->frames;
+}
+
+static void ringWrite(RewindBuffer *history, const size_t offset, const uint8_t *bytes, const size_t length)
+{
+    const size_t first = history->capacity - offset < length ? history->capacity - offset : length;
+    memcpy(history->ring + offset, bytes, first);
+    memcpy(history->ring, bytes + first, length - first);
+}
+
+static void ringRead(const RewindBuffer *history, const size_t offset, uint8_t *bytes, const size_t length)
+{
+    const size_t first = history->capacity - offset < length ? history->capacity - offset : length;
+    memcpy(bytes, history->ring + offset, first);
+    memcpy(bytes + first, history->ring, length - first);
+}
+
+static uint16_t ringRead16(const RewindBuffer *history, const size_t offset)
+{
+    uint8_t bytes[2];
+    ringRead(history, offset % history->capacity, bytes, 2);
+    return bytes[0] | (bytes[1] << 8);
+}
+
+static inline void put16(uint8_t *p, const size_t value)
+{
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+}
+
+static void dropOldest(RewindBuffer *history)
+{
+    const uint16_t length = ringRead16(history, history->tail);
+    history->tail = (history->tail + length) % history->capacity;
+    history->used -= length;
+    history->frames--;
+}
+
+// Writes older ^ newer over length bytes into out, returns its size
+static size_t encodeDelta(const uint8_t *older, const uint8_t *newer, const size_t length, uint8_t *out)
+{
+    uint8_t *p = out;
+    size_t i = 0;
+    while (i < length)
+    {
+        // Unchanged bytes, eight at a time where possible
+        const size_t zeroStart = i;
+        while (i + 8 <= length && memcmp(older + i, newer + i, 8) == 0)
+            i += 8;
+        while (i < length && older[i] == newer[i])
+            i++;
+        if (i == length)
+            break;
+
+        // Changed bytes up to the next run of MIN_ZERO_RUN unchanged ones
+        const size_t literalStart = i;
+        size_t zeros = 0;
+        while (i < length && zeros < MIN_ZERO_RUN)
+        {
+            zeros = older[i] == newer[i] ? zeros + 1 : 0;
+            i++;
+        }
+        if (zeros == MIN_ZERO_RUN)
+            i -= MIN_ZERO_RUN;
+        else
+            i -= zeros;
+
+        put16(p, literalStart - zeroStart);
+        put16(p + 2, i - literalStart);
+        p += 4;
+        for (size_t j = literalStart; j < i; j++)
+            *p++ = older[j] ^ newer[j];
+    }
+    return p - out;
+}
+
+// XORs a delta from encodeDelta into state
+static void applyDelta(uint8_t *state, const uint8_t *delta, const size_t length)
+{
+    const uint8_t *p = delta;
+    size_t offset = 0;
+    while (p < delta + length)
+    {
+        offset += p[0] | (p[1] << 8);
+        const size_t literals = p[2] | (p[3] << 8);
+        p += 4;
+        for (size_t i = 0; i < literals; i++)
+            state[offset + i] ^= p[i];
+        offset += literals;
+        p += literals;
+    }
+}
+
+// A frame whose state can't be saved, e.g. after the guest stack overflowed,
+// is left out of the history
+void pushRewind(RewindBuffer *history, const ChipContext *chip)
+{
+    if (history->newest < 0)
+    {
+        history->stateLength[0] = saveState(chip, history->state[0], MAX_SAVE_STATE_SIZE);
+        if (history->stateLength[0] > 0)
+            history->newest = 0;
+        return;
+    }
+
+    const int older = history->newest;
+    const int newer = older ^ 1;
+    uint8_t *state = history->state[newer];
+    const size_t length = saveState(chip, state, MAX_SAVE_STATE_SIZE);
+    if (length == 0)
+        return;
+    if (length < history->stateLength[newer])
+        memset(state + length, 0, history->stateLength[newer] - length);
+
+    const size_t olderLength = history->stateLength[older];
+    const size_t span = length > olderLength ? length : olderLength;
+    const size_t deltaLength = encodeDelta(history->state[older], state, span, history->record + RECORD_HEADER);
+    const size_t recordLength = deltaLength + RECORD_OVERHEAD;
+
+    put16(history->record, recordLength);
+    put16(history->record + 2, olderLength);
+    put16(history->record + RECORD_HEADER + deltaLength, recordLength);
+
+    while (history->frames > 0 && (history->frames >= history->maxFrames || history->used + recordLength > history->capacity))
+        dropOldest(history);
+
+    ringWrite(history, history->head, history->record, recordLength);
+    history->head = (history->head + recordLength) % history->capacity;
+    history->used += recordLength;
+    history->frames++;
+
+    history->newest = newer;
+    history->stateLength[newer] = length;
+}
+
+// Steps back one frame and restores it into chip. Returns nonzero when there
+// is no older frame left.
+int popRewind(RewindBuffer *history, ChipContext *chip)
+{
+    if (history->frames == 0)
+        return 1;
+
+    const uint16_t recordLength = ringRead16(history, history->head + history->capacity - 2);
+    const size_t start = (history->head + history->capacity - recordLength) % history->capacity;
+    ringRead(history, start, history->record, recordLength);
+
+    uint8_t *state = history->state[history->newest];
+    applyDelta(state, history->record + RECORD_HEADER, recordLength - RECORD_OVERHEAD);
+    const size_t olderLength = history->record[2] | (history->record[3] << 8);
+    history->stateLength[history->newest] = olderLength;
+
+    history->head = start;
+    history->used -= recordLength;
+    history->frames--;
+
+    return restoreState(chip, state, olderLength);
+}
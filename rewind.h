@@ -0,0 +1,19 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include "chip8.h"
+
+// Keeps the save states of the last frames in a fixed-size ring. Only the
+// newest state is kept whole; every older frame is stored as the XOR of its
+// state with the next one, run-length encoded, which is mostly zeros. All
+// memory is allocated up front.
+typedef struct RewindBuffer RewindBuffer;
+
+RewindBuffer *createRewind(const int maxFrames, const size_t capacity);
+void destroyRewind(RewindBuffer *history);
+void clearRewind(RewindBuffer *history);
+void pushRewind(RewindBuffer *history, const ChipContext *chip);
+int popRewind(RewindBuffer *history, ChipContext *chip);
+int rewindFrames(const RewindBuffer *history);
+
+#endif // REWIND_H
@@ -0,0 +1,197 @@
+#include "sampler.h"
+
+// Symbol file format: one "<hex address> <name>" per line, # starts a
+// comment. Unnamed subroutines are called sub_<address>.
+
+#define MAX_FRAMES 18 // Entry point, 16 subroutines and the PC
+#define MIN_CAPACITY 1024
+#define MAX_SYMBOL_LENGTH 64
+
+typedef struct Stack
+{
+  uint64_t count; // 0 for an empty slot
+  uint16_t frames[MAX_FRAMES];
+  uint8_t depth;
+} Stack;
+
+struct Sampler
+{
+  Stack *stacks;   // Open addressing hash table
+  size_t capacity; // Power of two
+  size_t used;
+  uint64_t samples;
+  int withPC;
+  char *symbols[MEMORY_SIZE]; // NULL where loadSymbols gave no name
+};
+
+Sampler *createSampler(const int withPC)
+{
+    Sampler *sampler = calloc(1, sizeof(Sampler));
+    if (!sampler)
+        return NULL;
+
+    sampler->stacks = calloc(MIN_CAPACITY, sizeof(Stack));
+    if (!sampler->stacks)
+    {
+        free(sampler);
+        return NULL;
+    }
+    sampler->capacity = MIN_CAPACITY;
+    sampler->withPC = withPC;
+    return sampler;
+}
+
+void destroySampler(Sampler *sampler)
+{
+    if (!sampler)
+        return;
+    for (int address = 0; address < MEMORY_SIZE; address++)
+        free(sampler->symbols[address]);
+    free(sampler->stacks);
+    free(sampler);
+}
+
+uint64_t sampleCount(const Sampler *sampler)
+{
+    return sampler->samples;
+}
+
+// FNV-1a over the frames
+static size_t hashStack(const Stack *stack)
+{
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < stack->depth; i++)
+    {
+        hash ^= stack->frames[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int sameStack(const Stack *a, const Stack *b)
+{
+    return a->depth == b->depth && memcmp(a->frames, b->frames, a->depth * sizeof(uint16_t)) == 0;
+}
+
+// Slot holding the stack, or the empty slot it goes into
+static Stack *findStack(Stack *stacks, const size_t capacity, const Stack *stack)
+{
+    size_t slot = hashStack(stack) & (capacity - 1);
+    while (stacks[slot].count && !sameStack(&stacks[slot], stack))
+        slot = (slot + 1) & (capacity - 1);
+    return &stacks[slot];
+}
+
+static int growStacks(Sampler *sampler)
+{
+    const size_t capacity = sampler->capacity * 2;
+    Stack *stacks = calloc(capacity, sizeof(Stack));
+    if (!stacks)
+        return 1;
+
+    for (size_t i = 0; i < sampler->capacity; i++)
+    {
+        if (sampler->stacks[i].count)
+            *findStack(stacks, capacity, &sampler->stacks[i]) = sampler->stacks[i];
+    }
+    free(sampler->stacks);
+    sampler->stacks = stacks;
+    sampler->capacity = capacity;
+    return 0;
+}
+
+// Counts the chip's current stack, returns nonzero if out of memory
+int recordSample(Sampler *sampler, const ChipContext *chip)
+{
+    Stack sample = {0};
+    sample.frames[sample.depth++] = ROM_START_ADDRESS;
+
+    // The instruction in front of a return address is the call that pushed
+    // it, which names the subroutine
+    const int depth = chip->SP < 16 ? chip->SP : 16;
+    for (int i = 0; i < depth; i++)
+    {
+        const uint16_t call = (chip->stack[i] - 2) & 0xFFF;
+        const uint16_t instruction = (chip->memory[call] << 8) | chip->memory[(call + 1) & 0xFFF];
+        sample.frames[sample.depth++] = (instruction & 0xF000) == 0x2000 ? instruction & 0xFFF : call;
+    }
+    if (sampler->withPC)
+        sample.frames[sample.depth++] = chip->PC & 0xFFF;
+
+    // Keep the table at most half full
+    if ((sampler->used + 1) * 2 > sampler->capacity && growStacks(sampler) != 0)
+        return 1;
+
+    Stack *stack = findStack(sampler->stacks, sampler->capacity, &sample);
+    if (!stack->count)
+    {
+        *stack = sample;
+        sampler->used++;
+    }
+    stack->count++;
+    sampler->samples++;
+    return 0;
+}
+
+int loadSymbols(Sampler *sampler, const char *filename)
+{
+    FILE *file = fopen(filename, "r");
+    if (!file)
+    {
+        printf("Failed to open symbol file: %s\n", filename);
+        return 1;
+    }
+
+    char line[256];
+    while (fgets(line, sizeof(line), file))
+    {
+        unsigned int address;
+        char name[MAX_SYMBOL_LENGTH];
+        if (line[0] == '#' || sscanf(line, "%x %63s", &address, name) != 2 || address >= MEMORY_SIZE)
+            continue;
+
+        char *copy = malloc(strlen(name) + 1);
+        if (!copy)
+            break;
+        strcpy(copy, name);
+        free(sampler->symbols[address]);
+        sampler->symbols[address] = copy;
+    }
+
+    fclose(file);
+    return 0;
+}
+
+static void writeFrame(const Sampler *sampler, FILE *out, const uint16_t address, const char *prefix)
+{
+    if (sampler->symbols[address])
+        fputs(sampler->symbols[address], out);
+    else
+        fprintf(out, "%s%03X", prefix, address);
+}
+
+// One "<frame>;<frame>;... <samples>" line per distinct stack, outermost
+// frame first. The PC, when sampled, is the last frame.
+void writeFoldedStacks(const Sampler *sampler, FILE *out)
+{
+    for (size_t i = 0; i < sampler->capacity; i++)
+    {
+        const Stack *stack = &sampler->stacks[i];
+        if (!stack->count)
+            continue;
+
+        const int calls = sampler->withPC ? stack->depth - 1 : stack->depth;
+        for (int frame = 0; frame < stack->depth; frame++)
+        {
+            if (frame > 0)
+                fputc(';', out);
+            if (frame == 0)
+                writeFrame(sampler, out, stack->frames[frame], "start_");
+            else if (frame < calls)
+                writeFrame(sampler, out, stack->frames[frame], "sub_");
+            else
+                writeFrame(sampler, out, stack->frames[frame], "pc_");
+        }
+        fprintf(out, " %llu\n", (unsigned long long)stack->count);
+    }
+}
@@ -0,0 +1,19 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "chip8.h"
+
+// Guest call stacks sampled from a running chip. A stack is the ROM's entry
+// point, the subroutine called by every return address on
+// ChipContext::stack and, optionally, the PC. Samples are counted per
+// distinct stack and written out in the folded format flamegraph tools read.
+typedef struct Sampler Sampler;
+
+Sampler *createSampler(const int withPC);
+void destroySampler(Sampler *sampler);
+int recordSample(Sampler *sampler, const ChipContext *chip);
+int loadSymbols(Sampler *sampler, const char *filename);
+void writeFoldedStacks(const Sampler *sampler, FILE *out);
+uint64_t sampleCount(const Sampler *sampler);
+
+#endif // SAMPLER_H
@@ -0,0 +1,158 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "scheduler.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+
+// The owner pushes and pops at the tail, thieves take from the head. Jobs
+// only go back after being taken from a deque, so the array never fills. A
+// mutex per deque is enough: the lock is only contended while stealing,
+// and a slice is much longer than the lock.
+typedef struct Deque
+{
+  pthread_mutex_t lock;
+  int *jobs; // Room for every job, so pushes never fail
+  int head;
+  int tail;
+} Deque;
+
+typedef struct Scheduler
+{
+  Deque *deques;
+  int threadCount;
+  SliceFunction slice;
+  void *context;
+
+  pthread_mutex_t lock;
+  int remaining; // Jobs not finished yet
+} Scheduler;
+
+typedef struct Worker
+{
+  Scheduler *scheduler;
+  int index;
+} Worker;
+
+static void pushJob(Deque *deque, const int job)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail == deque->head)
+        deque->tail = deque->head = 0; // Reuse the space from the start
+    deque->jobs[deque->tail++] = job;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+// Newest job of our own deque, or -1
+static int popJob(Deque *deque)
+{
+    int job = -1;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head)
+        job = deque->jobs[--deque->tail];
+    pthread_mutex_unlock(&deque->lock);
+    return job;
+}
+
+// Oldest job of someone else's deque, or -1
+static int stealJob(Deque *deque)
+{
+    int job = -1;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head)
+        job = deque->jobs[deque->head++];
+    pthread_mutex_unlock(&deque->lock);
+    return job;
+}
+
+static int jobsRemaining(Scheduler *scheduler)
+{
+    pthread_mutex_lock(&scheduler->lock);
+    const int remaining = scheduler->remaining;
+    pthread_mutex_unlock(&scheduler->lock);
+    return remaining;
+}
+
+static void *runWorker(void *argument)
+{
+    Worker *worker = argument;
+    Scheduler *scheduler = worker->scheduler;
+    Deque *own = &scheduler->deques[worker->index];
+
+    for (;;)
+    {
+        int job = popJob(own);
+        for (int i = 1; job < 0 && i < scheduler->threadCount; i++)
+            job = stealJob(&scheduler->deques[(worker->index + i) % scheduler->threadCount]);
+
+        if (job < 0)
+        {
+            // Whatever is left is running on other workers and may still be
+            // pushed back for us to steal
+            if (jobsRemaining(scheduler) == 0)
+                break;
+            sched_yield();
+            continue;
+        }
+
+        if (scheduler->slice(scheduler->context, job, worker->index))
+        {
+            pthread_mutex_lock(&scheduler->lock);
+            scheduler->remaining--;
+            pthread_mutex_unlock(&scheduler->lock);
+        }
+        else
+            pushJob(own, job);
+    }
+
+    return NULL;
+}
+
+int runScheduler(const int jobCount, const int threadCount, SliceFunction slice, void *context)
+{
+    Scheduler scheduler;
+    scheduler.threadCount = threadCount;
+    scheduler.slice = slice;
+    scheduler.context = context;
+    scheduler.remaining = jobCount;
+    pthread_mutex_init(&scheduler.lock, NULL);
+
+    scheduler.deques = calloc(threadCount, sizeof(Deque));
+    Worker *workers = calloc(threadCount, sizeof(Worker));
+    pthread_t *threads = calloc(threadCount, sizeof(pthread_t));
+    if (!scheduler.deques || !workers || !threads)
+        return 1;
+
+    for (int i = 0; i < threadCount; i++)
+    {
+        pthread_mutex_init(&scheduler.deques[i].lock, NULL);
+        scheduler.deques[i].jobs = malloc((jobCount > 0 ? jobCount : 1) * sizeof(int));
+        if (!scheduler.deques[i].jobs)
+            return 1;
+    }
+
+    // Deal the jobs out in reverse so every worker starts with the lowest
+    // indices it was given
+    for (int job = jobCount - 1; job >= 0; job--)
+        pushJob(&scheduler.deques[job % threadCount], job);
+
+    for (int i = 0; i < threadCount; i++)
+    {
+        workers[i].scheduler = &scheduler;
+        workers[i].index = i;
+        pthread_create(&threads[i], NULL, runWorker, &workers[i]);
+    }
+    for (int i = 0; i < threadCount; i++)
+        pthread_join(threads[i], NULL);
+
+    for (int i = 0; i < threadCount; i++)
+    {
+        pthread_mutex_destroy(&scheduler.deques[i].lock);
+        free(scheduler.deques[i].jobs);
+    }
+    pthread_mutex_destroy(&scheduler.lock);
+    free(scheduler.deques);
+    free(workers);
+    free(threads);
+    return 0;
+}
@@ -0,0 +1,16 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+// Work-stealing thread pool for jobs that run in slices. Every worker keeps
+// its own deque of job indices, runs the newest one for a slice and puts it
+// back until it finishes; an idle worker takes the oldest job from another
+// worker's deque. Long jobs keep running where they are while short ones
+// spread out over the idle cores.
+
+// Runs one slice of a job. Returns nonzero once the job is finished.
+typedef int (*SliceFunction)(void *context, const int job, const int worker);
+
+// Runs jobs 0 to jobCount - 1 to completion, returns nonzero on failure
+int runScheduler(const int jobCount, const int threadCount, SliceFunction slice, void *context);
+
+#endif // SCHEDULER_H
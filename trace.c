@@ -0,0 +1,260 @@
+#include "trace.h"
+
+// Trace file layout, multi-byte values little endian:
+//   "C8T" version
+//   instructions traced in total, records in the file
+//   records, oldest first: PC, instruction, I, Vx, VF
+
+#define TRACE_HEADER_SIZE (4 + 8 + 4)
+#define TRACE_RECORD_SIZE 8
+
+static void put16(uint8_t *p, const uint16_t value)
+{
+    p[0] = value & 0xFF;
+    p[1] = value >> 8;
+}
+
+static void put32(uint8_t *p, const uint32_t value)
+{
+    put16(p, value & 0xFFFF);
+    put16(p + 2, value >> 16);
+}
+
+static void put64(uint8_t *p, const uint64_t value)
+{
+    put32(p, value & 0xFFFFFFFF);
+    put32(p + 4, value >> 32);
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+static uint64_t get64(const uint8_t *p)
+{
+    return get32(p) | ((uint64_t)get32(p + 4) << 32);
+}
+
+TraceBuffer *createTrace(void)
+{
+    return calloc(1, sizeof(TraceBuffer));
+}
+
+void destroyTrace(TraceBuffer *trace)
+{
+    free(trace);
+}
+
+static uint32_t recordCount(const TraceBuffer *trace)
+{
+    return trace->next < TRACE_RECORDS ? (uint32_t)trace->next : TRACE_RECORDS;
+}
+
+int saveTrace(const TraceBuffer *trace, const char *filename)
+{
+    FILE *file = fopen(filename, "wb");
+    if (!file)
+    {
+        printf("Failed to create trace file: %s\n", filename);
+        return 1;
+    }
+
+    const uint32_t count = recordCount(trace);
+    uint8_t header[TRACE_HEADER_SIZE] = {'C', '8', 'T', TRACE_VERSION};
+    put64(header + 4, trace->next);
+    put32(header + 12, count);
+    int failed = fwrite(header, sizeof(header), 1, file) != 1;
+
+    for (uint64_t i = trace->next - count; i != trace->next && !failed; i++)
+    {
+        const TraceRecord *record = &trace->records[i & (TRACE_RECORDS - 1)];
+        uint8_t bytes[TRACE_RECORD_SIZE];
+        put16(bytes, record->PC);
+        put16(bytes + 2, record->instruction);
+        put16(bytes + 4, record->I);
+        bytes[6] = record->vx;
+        bytes[7] = record->vf;
+        failed = fwrite(bytes, sizeof(bytes), 1, file) != 1;
+    }
+
+    if (fclose(file) != 0 || failed)
+    {
+        printf("Failed to write trace file: %s\n", filename);
+        return 1;
+    }
+    return 0;
+}
+
+// Puts the records back where they were, so next - 1 is again the newest
+int loadTrace(TraceBuffer *trace, const char *filename)
+{
+    memset(trace, 0, sizeof(TraceBuffer));
+
+    FILE *file = fopen(filename, "rb");
+    if (!file)
+    {
+        printf("Failed to open trace file: %s\n", filename);
+        return 1;
+    }
+
+    uint8_t header[TRACE_HEADER_SIZE];
+    if (fread(header, sizeof(header), 1, file) != 1 ||
+        header[0] != 'C' || header[1] != '8' || header[2] != 'T' || header[3] != TRACE_VERSION)
+    {
+        printf("Not a version %d trace file: %s\n", TRACE_VERSION, filename);
+        fclose(file);
+        return 1;
+    }
+
+    const uint64_t next = get64(header + 4);
+    const uint32_t count = get32(header + 12);
+    if (count > TRACE_RECORDS || count > next)
+    {
+        printf("Trace file is corrupt: %s\n", filename);
+        fclose(file);
+        return 1;
+    }
+
+    for (uint64_t i = next - count; i != next; i++)
+    {
+        uint8_t bytes[TRACE_RECORD_SIZE];
+        if (fread(bytes, sizeof(bytes), 1, file) != 1)
+        {
+            printf("Trace file is truncated: %s\n", filename);
+            fclose(file);
+            return 1;
+        }
+        TraceRecord *record = &trace->records[i & (TRACE_RECORDS - 1)];
+        record->PC = get16(bytes);
+        record->instruction = get16(bytes + 2);
+        record->I = get16(bytes + 4);
+        record->vx = bytes[6];
+        record->vf = bytes[7];
+    }
+    trace->next = next;
+
+    fclose(file);
+    return 0;
+}
+
+// Cowgod's mnemonics, e.g. "LD V3, 0x1F"
+void disassemble(const uint16_t instruction, char *text, const size_t size)
+{
+    DecodedInstruction op;
+    decodeInstruction(instruction, &op);
+
+    switch (op.opcode)
+    {
+    case OP_CLS:
+        snprintf(text, size, "CLS");
+        break;
+    case OP_RET:
+        snprintf(text, size, "RET");
+        break;
+    case OP_JP:
+        snprintf(text, size, "JP 0x%03X", op.nnn);
+        break;
+    case OP_CALL:
+        snprintf(text, size, "CALL 0x%03X", op.nnn);
+        break;
+    case OP_SE_BYTE:
+        snprintf(text, size, "SE V%X, 0x%02X", op.x, op.kk);
+        break;
+    case OP_SNE_BYTE:
+        snprintf(text, size, "SNE V%X, 0x%02X", op.x, op.kk);
+        break;
+    case OP_SE_REG:
+        snprintf(text, size, "SE V%X, V%X", op.x, op.y);
+        break;
+    case OP_LD_BYTE:
+        snprintf(text, size, "LD V%X, 0x%02X", op.x, op.kk);
+        break;
+    case OP_ADD_BYTE:
+        snprintf(text, size, "ADD V%X, 0x%02X", op.x, op.kk);
+        break;
+    case OP_LD_REG:
+        snprintf(text, size, "LD V%X, V%X", op.x, op.y);
+        break;
+    case OP_OR:
+        snprintf(text, size, "OR V%X, V%X", op.x, op.y);
+        break;
+    case OP_AND:
+        snprintf(text, size, "AND V%X, V%X", op.x, op.y);
+        break;
+    case OP_XOR:
+        snprintf(text, size, "XOR V%X, V%X", op.x, op.y);
+        break;
+    case OP_ADD_REG:
+        snprintf(text, size, "ADD V%X, V%X", op.x, op.y);
+        break;
+    case OP_SUB:
+        snprintf(text, size, "SUB V%X, V%X", op.x, op.y);
+        break;
+    case OP_SHR:
+        snprintf(text, size, "SHR V%X, V%X", op.x, op.y);
+        break;
+    case OP_SUBN:
+        snprintf(text, size, "SUBN V%X, V%X", op.x, op.y);
+        break;
+    case OP_SHL:
+        snprintf(text, size, "SHL V%X, V%X", op.x, op.y);
+        break;
+    case OP_SNE_REG:
+        snprintf(text, size, "SNE V%X, V%X", op.x, op.y);
+        break;
+    case OP_LD_I:
+        snprintf(text, size, "LD I, 0x%03X", op.nnn);
+        break;
+    case OP_JP_V0:
+        snprintf(text, size, "JP V0, 0x%03X", op.nnn);
+        break;
+    case OP_RND:
+        snprintf(text, size, "RND V%X, 0x%02X", op.x, op.kk);
+        break;
+    case OP_DRW:
+        snprintf(text, size, "DRW V%X, V%X, %d", op.x, op.y, op.n);
+        break;
+    case OP_SKP:
+        snprintf(text, size, "SKP V%X", op.x);
+        break;
+    case OP_SKNP:
+        snprintf(text, size, "SKNP V%X", op.x);
+        break;
+    case OP_LD_VX_DT:
+        snprintf(text, size, "LD V%X, DT", op.x);
+        break;
+    case OP_LD_VX_K:
+        snprintf(text, size, "LD V%X, K", op.x);
+        break;
+    case OP_LD_DT_VX:
+        snprintf(text, size, "LD DT, V%X", op.x);
+        break;
+    case OP_LD_ST_VX:
+        snprintf(text, size, "LD ST, V%X", op.x);
+        break;
+    case OP_ADD_I_VX:
+        snprintf(text, size, "ADD I, V%X", op.x);
+        break;
+    case OP_LD_F_VX:
+        snprintf(text, size, "LD F, V%X", op.x);
+        break;
+    case OP_LD_B_VX:
+        snprintf(text, size, "LD B, V%X", op.x);
+        break;
+    case OP_LD_MEM_VX:
+        snprintf(text, size, "LD [I], V%X", op.x);
+        break;
+    case OP_LD_VX_MEM:
+        snprintf(text, size, "LD V%X, [I]", op.x);
+        break;
+    default:
+        snprintf(text, size, "DW 0x%04X", instruction);
+        break;
+    }
+}
@@ -0,0 +1,21 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "chip8.h"
+
+#define TRACE_VERSION 2
+
+// Pointing ChipContext::trace at a TraceBuffer makes the interpreter record
+// every instruction it runs (the JIT and the lockstep lanes don't). The
+// buffer is allocated once and written by the thread running the chip
+// without locks, so it can stay attached in normal play. saveTrace, called
+// from that thread, writes the last TRACE_RECORDS instructions to a file,
+// e.g. for a crash report.
+
+TraceBuffer *createTrace(void);
+void destroyTrace(TraceBuffer *trace);
+int saveTrace(const TraceBuffer *trace, const char *filename);
+int loadTrace(TraceBuffer *trace, const char *filename);
+void disassemble(const uint16_t instruction, char *text, const size_t size);
+
+#endif // TRACE_H
@@ -0,0 +1,84 @@
+#include "chip8.h"
+#include "trace.h"
+
+// Prints a trace file saved by saveTrace as a disassembly, oldest
+// instruction first, with the registers each instruction changed:
+//   <instruction number> <PC> <instruction> <mnemonic> <changed registers>
+
+// Appends the registers an instruction writes, as they were after it ran
+static void describeChanges(const TraceRecord *record, char *text, const size_t size)
+{
+    DecodedInstruction op;
+    decodeInstruction(record->instruction, &op);
+
+    int writesVx = 0, writesVF = 0, writesI = 0;
+    switch (op.opcode)
+    {
+    case OP_ADD_REG:
+    case OP_SUB:
+    case OP_SHR:
+    case OP_SUBN:
+    case OP_SHL:
+        writesVF = 1;
+        writesVx = 1;
+        break;
+    case OP_LD_BYTE:
+    case OP_ADD_BYTE:
+    case OP_LD_REG:
+    case OP_OR:
+    case OP_AND:
+    case OP_XOR:
+    case OP_RND:
+    case OP_LD_VX_DT:
+    case OP_LD_VX_K:
+    case OP_LD_VX_MEM:
+        writesVx = 1;
+        break;
+    case OP_DRW:
+        writesVF = 1;
+        break;
+    case OP_LD_I:
+    case OP_ADD_I_VX:
+    case OP_LD_F_VX:
+        writesI = 1;
+        break;
+    }
+
+    int length = 0;
+    text[0] = '\0';
+    if (writesVx && op.x != 0xF)
+        length += snprintf(text + length, size - length, "V%X=%02X", op.x, record->vx);
+    if (writesVF || (writesVx && op.x == 0xF))
+        length += snprintf(text + length, size - length, "%sVF=%02X", length ? " " : "", record->vf);
+    if (writesI)
+        snprintf(text + length, size - length, "%sI=%03X", length ? " " : "", record->I);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        printf("Usage: %s <trace>\n", argv[0]);
+        return 1;
+    }
+
+    // TraceBuffer is too big for the stack
+    static TraceBuffer trace;
+    if (loadTrace(&trace, argv[1]) != 0)
+        return 1;
+
+    const uint32_t count = trace.next < TRACE_RECORDS ? (uint32_t)trace.next : TRACE_RECORDS;
+    for (uint64_t i = trace.next - count; i != trace.next; i++)
+    {
+        const TraceRecord *record = &trace.records[i & (TRACE_RECORDS - 1)];
+        char mnemonic[32], changes[32];
+        disassemble(record->instruction, mnemonic, sizeof(mnemonic));
+        describeChanges(record, changes, sizeof(changes));
+        printf("%10llu  %03X  %04X  ", (unsigned long long)i, record->PC, record->instruction);
+        if (changes[0])
+            printf("%-16s %s\n", mnemonic, changes);
+        else
+            printf("%s\n", mnemonic);
+    }
+    return 0;
+}